@@ -1,28 +1,407 @@
+#if defined(_WIN32) && (!defined(_WIN32_WINNT) || _WIN32_WINNT < 0x0600)
+// WSAPoll and struct pollfd need vista headers
+#undef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600
+#endif
 #include <obs-module.h>
 #include <obs-frontend-api.h>
-#include <curl.h>
+#include <util/threading.h>
+#include <util/platform.h>
+#include <util/dstr.h>
+#include <util/darray.h>
+#include <util/profiler.h>
+#include <curl/curl.h>
 #include <stdio.h>
+#include <time.h>
+#include <limits.h>
+#include <math.h>
+#ifdef _WIN32
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
+
+#define START_TIMEOUT_MS 10000
+// how long shutdown waits for a queued stopLive
+#define STOP_EXIT_TIMEOUT_MS 3000
+#define STOP_RETRY_MS 2000
+#define STOP_RETRY_MAX_MS 60000
+// live status polling backs off from fast to slow while the room stays live
+#define WATCH_FAST_MS 2000
+#define WATCH_SLOW_MS 60000
+#define API_HOST "https://api.live.bilibili.com"
+// seconds before the cached area list is revalidated
+#define AREA_CACHE_TTL (24 * 60 * 60)
+#define AREA_CACHE_FILE "areas.json"
+#define CREDENTIALS_FILE "credentials.json"
+#define INGEST_MAX 8
+#define INGEST_PROBE_TIMEOUT_MS 2000
+// rtt charged to an ingest that could not be reached
+#define INGEST_FAIL_RTT 5000.0
+#define INGEST_SMOOTHING 0.3
+#define API_CONNECT_TIMEOUT_MS 3000
+#define API_TIMEOUT_MS 8000
+// retries of read-only calls, all attempts together stay within the budget
+#define API_RETRIES 2
+#define API_RETRY_BUDGET_MS 8000
+#define API_BACKOFF_MS 200
+#define LATENCY_WINDOW 32
+// samples needed before a slow read-only call gets a hedge
+#define HEDGE_MIN_SAMPLES 8
+// metrics cover the current and the previous window
+#define METRICS_WINDOW_SEC 600
+#define METRICS_FILE "metrics.csv"
+#define HISTOGRAM_BUCKETS 14
+#define COOKIE_SLOTS 64
+// longest cookie name or value kept
+#define COOKIE_MAX_LEN 1024
+#define COOKIE_DOMAIN ".bilibili.com"
+#define DANMAKU_HOST "broadcastlv.chat.bilibili.com"
+#define DANMAKU_PORT 2243
+#define DANMAKU_HEADER_SIZE 16
+#define DANMAKU_OP_HEARTBEAT 2
+#define DANMAKU_OP_MESSAGE 5
+#define DANMAKU_OP_AUTH 7
+#define DANMAKU_HEARTBEAT_MS 30000
+#define DANMAKU_RETRY_MS 1000
+#define DANMAKU_RETRY_MAX_MS 30000
+// largest packet accepted from the server
+#define DANMAKU_RECV_BUFFER (64 * 1024)
+#define DANMAKU_RING_SIZE 256
+#define DANMAKU_USER_MAX 32
+#define DANMAKU_TEXT_MAX 128
+#define DANMAKU_UPDATE_INTERVAL 0.1f
 
 OBS_DECLARE_MODULE();
+typedef enum bilibili_task_def {
+    task_prepare = 1 << 0,
+    task_start   = 1 << 1,
+    task_probe   = 1 << 2,
+    task_stop    = 1 << 3,
+    task_watch   = 1 << 4
+} bilibili_task;
+#define JSON_MAX_DEPTH 32
+#define JSON_MAX_PATH 256
+// longest string or number that will be captured
+#define JSON_MAX_TOKEN 4096
+#define ARENA_BLOCK_SIZE 4096
+
 typedef struct {
     char *buf;
     size_t size;
+    size_t capacity;
 } simple_buffer;
+typedef struct arena_block_def {
+    struct arena_block_def *next;
+    size_t used;
+    size_t size;
+    char data[];
+} arena_block;
+/**
+ * bump allocator for strings that all die together, released in one shot
+ */
+typedef struct arena_def {
+    arena_block *head;
+} arena;
+typedef enum json_state_def {
+    json_value,
+    json_value_or_end,
+    json_key,
+    json_key_or_end,
+    json_colon,
+    json_after_value,
+    json_string,
+    json_escape,
+    json_unicode,
+    json_literal,
+    json_done
+} json_state;
+/**
+ * index: position in the paths given to json_stream_init
+ * value: NULL when an object or array at that path ends
+ */
+typedef void (*json_value_cb)(void *param, size_t index, const char *value);
+/**
+ * pulls values at a few paths out of a json document fed in chunks,
+ * paths look like "data.rtmp.addr" or "data[].list[].name"
+ */
+typedef struct json_stream_def {
+    const char **paths;
+    size_t path_count;
+    json_value_cb cb;
+    void *param;
+
+    json_state state;
+    bool in_key;
+    bool capture;
+    bool error;
+    int depth;
+    char stack[JSON_MAX_DEPTH];
+    size_t base[JSON_MAX_DEPTH];
+    char path[JSON_MAX_PATH];
+    size_t path_len;
+    simple_buffer token;
+    uint32_t unicode;
+    uint32_t high_surrogate;
+    int unicode_digits;
+} json_stream;
+typedef enum endpoint_def {
+    endpoint_get_list,
+    endpoint_liveinfo,
+    endpoint_start_live,
+    endpoint_stop_live,
+    endpoint_room_init,
+    endpoint_count
+} endpoint;
+typedef struct endpoint_info_def {
+    const char *name;
+    const char *url;
+    // safe to retry and to hedge
+    bool read_only;
+} endpoint_info;
+typedef struct latency_window_def {
+    double samples[LATENCY_WINDOW];
+    size_t count;
+} latency_window;
+typedef enum metric_phase_def {
+    phase_dns,
+    phase_connect,
+    phase_tls,
+    // request sent until the first byte, i.e. time spent by the api
+    phase_ttfb,
+    phase_total,
+    phase_count
+} metric_phase;
+typedef struct metrics_window_def {
+    uint32_t requests;
+    uint32_t curl_errors[CURL_LAST];
+    // 1xx..5xx, 0 when there was no response
+    uint32_t http[6];
+    // body bytes on the wire and after content decoding
+    uint64_t bytes;
+    uint64_t decoded_bytes;
+    uint64_t max_bytes;
+    uint32_t phases[phase_count][HISTOGRAM_BUCKETS];
+} metrics_window;
+typedef struct endpoint_metrics_def {
+    metrics_window window[2];
+    // start of window[0] in seconds
+    uint64_t started;
+} endpoint_metrics;
+typedef struct cookie_entry_def {
+    char *name;
+    char *value;
+} cookie_entry;
+/**
+ * name -> value, open addressing over a fixed table
+ */
+typedef struct cookie_jar_def {
+    cookie_entry slots[COOKIE_SLOTS];
+    size_t count;
+    // bumped on every change so that handles reload curl's copy
+    uint32_t version;
+} cookie_jar;
+typedef struct http_conn_def {
+    CURL *curl;
+    endpoint ep;
+    cookie_jar *jar;
+    // version of jar loaded into curl's cookie engine
+    uint32_t jar_version;
+    simple_buffer buffer;
+    // when set the body is parsed as it arrives instead of buffered
+    json_stream *json;
+    struct curl_slist *headers;
+    struct dstr url;
+    CURLcode result;
+    long status;
+    // body bytes handed to writefunc after content decoding
+    uint64_t decoded;
+    char *etag;
+    char *last_modified;
+
+    bool running;
+    bool done;
+    double hedge_after;
+    // duplicate of a slow read-only request, the first to answer wins
+    struct http_conn_def *hedge;
+    bool hedge_active;
+    struct http_conn_def *primary;
+    struct http_conn_def *winner;
+} http_conn;
+typedef enum conn_slot_def {
+    conn_main,
+    conn_aux,
+    conn_watch,
+    conn_count
+} conn_slot;
+typedef struct area_entry_def {
+    char *name;
+    int32_t id;
+} area_entry;
+typedef struct area_parse_def {
+    DARRAY(area_entry) entries;
+    // names of this response, gone with the request
+    arena names;
+    char *name;
+    int32_t id;
+} area_parse;
+/**
+ * name -> id of every sub area, open addressing, shared by all services
+ */
+typedef struct area_index_def {
+    pthread_mutex_t mutex;
+    area_entry *slots;
+    size_t capacity;
+    size_t count;
+    // names in byte order, borrowed from slots, for the picker
+    char **sorted;
+    arena names;
+    char *etag;
+    char *last_modified;
+    int64_t fetched_at;
+} area_index;
+typedef struct ingest_def {
+    char *url;
+    // smoothed tcp connect time in ms, < 0 until the first probe answers
+    double rtt;
+    uint32_t failures;
+} ingest;
+typedef struct sim_room_def {
+    char *cookie;
+    cookie_jar jar;
+    long long room_id;
+    // startLive went through and stopLive did not yet
+    bool live;
+    http_conn conn;
+    // parser state of the call in flight
+    json_stream json;
+    char *fields[3];
+} sim_room;
+typedef struct live_room_def {
+    // service that started the room, never adopts its own entry
+    struct bilibili_service_def *owner;
+    long long room_id;
+    char *addr;
+    char *code;
+    // services streaming to it, stopLive waits for the last one
+    int users;
+} live_room;
 typedef struct bilibili_service_def {
     char *cookie;
     char *area;
     bool auto_stop;
-    simple_buffer buffer;
+    // reused for every request so the connections stay alive
+    http_conn conn[conn_count];
+    CURLM *multi;
     int32_t area_id;
     obs_service_t *context;
     long long room_id;
     char *addr;
     char *code;
-    char csrf_token[64];
+    // parsed from cookie, kept current from Set-Cookie
+    cookie_jar jar;
+
+    pthread_t worker;
+    bool worker_valid;
+    // guards pending_settings, the worker owns everything it configures
+    pthread_mutex_t mutex;
+    // newest settings the worker has not applied yet
+    obs_data_t *pending_settings;
+    pthread_mutex_t task_mutex;
+    os_event_t *task_event;
+    uint32_t tasks;
+    // settings changed but this is not the streaming service yet
+    bool prefetch_pending;
+    volatile bool exiting;
+    bool start_requested;
+    // whichever of request_start and request_stop came last
+    bool want_live;
+    bool start_ok;
+    os_event_t *started;
+
+    // addr and code may be served before startLive answers: loaded from disk
+    // or confirmed by an earlier start, cleared by a failed start or a new account
+    bool creds_cached;
+    // counted in the users of the live_rooms entry of room_id, worker only
+    bool holds_room;
+    // what get_url/get_key handed to the output
+    char *served_addr;
+    char *served_code;
+    bool served_cached;
+    bool reconnecting;
+
+    // stopLive is queued or waiting for a retry, guarded by task_mutex
+    bool stop_pending;
+    int stop_attempts;
+    uint64_t stop_retry_at;
+    bool stop_registered;
+
+    // live status watchdog, guarded by task_mutex
+    bool watching;
+    uint64_t watch_at;
+    uint32_t watch_interval;
+    bool watch_alerted;
+    // last answer, only touched by the worker
+    int watch_live;
+    char *watch_etag;
+    os_event_t *stopped;
+
+    // candidates from startLive and the settings, owned by the worker
+    DARRAY(ingest) ingests;
+    // fastest candidate, guarded by task_mutex
+    char *ingest_addr;
+
+    // other accounts started and stopped together with this one, owned by the worker
+    DARRAY(sim_room) sims;
 } bilibili_service;
 void bilibili_update(void *data, obs_data_t *settings);
 void reset_buffer(simple_buffer *buf);
 void reset_service(bilibili_service *s);
+void *bilibili_worker(void *data);
+void bilibili_frontend_event(enum obs_frontend_event event, void *data);
+void bilibili_frontend_stop(enum obs_frontend_event event, void *data);
+void http_conn_free(http_conn *c);
+uint32_t hash_bytes(const char *data, size_t len);
+void cookie_jar_clear(cookie_jar *jar);
+void sim_room_free(sim_room *r);
+void area_index_fill_list(obs_property_t *p);
+void unpublish_owner(bilibili_service *owner);
+void queue_prefetch(bilibili_service *s);
+void save_stop_pending(long long room_id, bool pending);
+void emit_room_live(bilibili_service *s, sim_room *r);
+int release_room(bilibili_service *s);
+
+/**
+ * dns cache, tls sessions and connections shared by every service
+ */
+CURLSH *curl_share = NULL;
+pthread_mutex_t share_mutex[CURL_LOCK_DATA_LAST];
+area_index areas;
+pthread_mutex_t credentials_mutex;
+const endpoint_info endpoints[endpoint_count] = {
+    {"getList",   API_HOST "/room/v1/Area/getList",   true},
+    {"liveinfo",  API_HOST "/i/api/liveinfo",         true},
+    {"startLive", API_HOST "/room/v1/Room/startLive", false},
+    {"stopLive",  API_HOST "/room/v1/Room/stopLive",  false},
+    {"room_init", API_HOST "/room/v1/Room/room_init", true}
+};
+/**
+ * rooms put live in this process, another output streaming to the same
+ * room reuses the ingest instead of calling startLive again
+ */
+DARRAY(live_room) live_rooms;
+pthread_mutex_t rooms_mutex;
+latency_window latencies[endpoint_count];
+endpoint_metrics metrics[endpoint_count];
+pthread_mutex_t metrics_mutex;
+const char *phase_names[phase_count] = {"dns", "connect", "tls", "ttfb", "total"};
+// upper bounds in ms, the last bucket is open
+const double histogram_bounds[HISTOGRAM_BUCKETS - 1] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000
+};
+const char profile_prepare[] = "bilibili prepare_ids";
+const char profile_start_live[] = "bilibili startLive";
+const char profile_stop_live[] = "bilibili stopLive";
 
 void my_strdup(char **p, const char *str)
 {
@@ -38,27 +417,92 @@ const char* bilibili_name(void* data)
 void *bilibili_create(obs_data_t *settings, obs_service_t *service)
 {
     bilibili_service *s = bzalloc(sizeof(bilibili_service));
-    bilibili_update(s, settings);
-
     s->area_id = -1;
     s->context = service;
+
+    pthread_mutex_init_value(&s->mutex);
+    pthread_mutex_init_value(&s->task_mutex);
+    if (pthread_mutex_init(&s->mutex, NULL) != 0 ||
+        pthread_mutex_init(&s->task_mutex, NULL) != 0 ||
+        os_event_init(&s->task_event, OS_EVENT_TYPE_AUTO) != 0 ||
+        os_event_init(&s->started, OS_EVENT_TYPE_MANUAL) != 0 ||
+        os_event_init(&s->stopped, OS_EVENT_TYPE_MANUAL) != 0)
+    {
+        blog(LOG_ERROR, "failed to create bilibili service sync objects");
+    }
+    else
+    {
+        s->worker_valid = pthread_create(&s->worker, NULL, bilibili_worker, s) == 0;
+    }
+
+    bilibili_update(s, settings);
+    obs_frontend_add_event_callback(bilibili_frontend_event, s);
     return s;
 }
 
 void bilibili_destroy(void *data)
 {
     bilibili_service *s = data;
+    obs_frontend_remove_event_callback(bilibili_frontend_event, s);
+    obs_frontend_remove_event_callback(bilibili_frontend_stop, s);
+    if (s->worker_valid)
+    {
+        // a request in flight gives up within one multi wait
+        os_atomic_set_bool(&s->exiting, true);
+        os_event_signal(s->task_event);
+        pthread_join(s->worker, NULL);
+    }
+    // an owner still streaming may stop the room once we are gone
+    release_room(s);
+    unpublish_owner(s);
+    obs_data_release(s->pending_settings);
+
+    for (int i = 0; i < conn_count; i++)
+    {
+        http_conn_free(&s->conn[i]);
+    }
+    for (size_t i = 0; i < s->sims.num; i++)
+    {
+        sim_room_free(&s->sims.array[i]);
+    }
+    da_free(s->sims);
+    if (s->multi)
+    {
+        curl_multi_cleanup(s->multi);
+    }
     reset_service(s);
-    bfree(s->buffer.buf);
+    for (size_t i = 0; i < s->ingests.num; i++)
+    {
+        bfree(s->ingests.array[i].url);
+    }
+    da_free(s->ingests);
+    bfree(s->ingest_addr);
+    bfree(s->served_addr);
+    bfree(s->served_code);
+    bfree(s->watch_etag);
+    // reset_service still takes task_mutex
+    os_event_destroy(s->task_event);
+    os_event_destroy(s->started);
+    os_event_destroy(s->stopped);
+    pthread_mutex_destroy(&s->mutex);
+    pthread_mutex_destroy(&s->task_mutex);
     bfree(s);
 }
 
+/**
+ * gdi+ text on windows, freetype text elsewhere, both take "text"
+ */
+bool is_text_source(const char *id)
+{
+    return strcmp("text_gdiplus", id) == 0 || strcmp("text_ft2_source", id) == 0;
+}
+
 void output(const char *str, const char *src)
 {
     obs_source_t *s = obs_get_source_by_name(src);
     if (s)
     {
-        if (strcmp("text_gdiplus", obs_source_get_id(s)) == 0)
+        if (is_text_source(obs_source_get_id(s)))
         {
             obs_data_t *settings = obs_data_create();
             obs_data_set_string(settings, "text", str);
@@ -79,337 +523,3913 @@ void outputf(const char* format, ...)
     output(buf, "output_bilibili");
 }
 
+/**
+ * room and stream credentials belong to the account behind the cookie
+ */
+void reset_account(bilibili_service *s)
+{
+    pthread_mutex_lock(&s->task_mutex);
+    bfree(s->code);
+    bfree(s->addr);
+    s->code = NULL;
+    s->addr = NULL;
+    s->creds_cached = false;
+    pthread_mutex_unlock(&s->task_mutex);
+    s->room_id = 0;
+}
+
 void reset_service(bilibili_service *s)
 {
     bfree(s->cookie);
     bfree(s->area);
-    bfree(s->code);
-    bfree(s->addr);
-    reset_buffer(&s->buffer);
+    cookie_jar_clear(&s->jar);
+    s->cookie = NULL;
+    s->area = NULL;
+    s->area_id = -1;
+    reset_account(s);
+}
+
+void cookie_jar_clear(cookie_jar *jar)
+{
+    for (size_t i = 0; i < COOKIE_SLOTS; i++)
+    {
+        bfree(jar->slots[i].name);
+        bfree(jar->slots[i].value);
+    }
+    memset(jar->slots, 0, sizeof(jar->slots));
+    jar->count = 0;
+    jar->version++;
 }
 
-void trim_cookie(bilibili_service *s)
+cookie_entry *cookie_slot(cookie_jar *jar, const char *name, size_t len)
 {
-    char *r = s->cookie;
-    char *w = s->cookie;
-    while (*r != '\0')
+    uint32_t h = hash_bytes(name, len);
+    for (size_t i = 0; i < COOKIE_SLOTS; i++)
     {
-        char c = *r;
-        if (!(c == '\r' || c == '\n'))
+        cookie_entry *e = &jar->slots[(h + i) & (COOKIE_SLOTS - 1)];
+        if (!e->name || (strlen(e->name) == len && memcmp(e->name, name, len) == 0))
         {
-            *w++ = *r;
+            return e;
         }
-        r++;
     }
-    *w = *r;
+    return NULL;
 }
 
-bool update_csrf_token(bilibili_service *s)
+bool cookie_jar_set(cookie_jar *jar, const char *name, size_t name_len, const char *value, size_t value_len)
 {
-    const char *jct = "bili_jct=";
-    char *begin = strstr(s->cookie, jct);
-    if (begin == NULL)
+    if (!name_len || name_len >= COOKIE_MAX_LEN || value_len >= COOKIE_MAX_LEN)
+    {
+        return false;
+    }
+    cookie_entry *e = cookie_slot(jar, name, name_len);
+    if (!e)
     {
-        blog(LOG_ERROR, "csrf token begin null");
         return false;
     }
-    begin += strlen(jct);
-    char *end = strstr(begin, ";");
-    if (end == NULL && end != begin)
+    if (e->name && strlen(e->value) == value_len && memcmp(e->value, value, value_len) == 0)
     {
-        end = begin + strlen(begin);
+        return true;
     }
-    if (end - begin > 60)
+    if (!e->name)
     {
-        blog(LOG_ERROR, "csrf token too long");
-        return false;
+        // keep the table sparse so that probes stay short
+        if (jar->count >= COOKIE_SLOTS * 3 / 4)
+        {
+            return false;
+        }
+        e->name = bstrdup_n(name, name_len);
+        jar->count++;
     }
-    memset(s->csrf_token, 0, sizeof(s->csrf_token));
-    memcpy(s->csrf_token, begin, end - begin);
-    blog(LOG_DEBUG, "csrf: %s", s->csrf_token);
+    bfree(e->value);
+    e->value = bstrdup_n(value, value_len);
+    jar->version++;
     return true;
 }
 
-void bilibili_update(void *data, obs_data_t *settings)
+const char *cookie_jar_get(cookie_jar *jar, const char *name)
 {
-    bilibili_service *service = data;
-
-    reset_service(service);
-
-    my_strdup(&service->cookie, obs_data_get_string(settings, "cookie"));
-    my_strdup(&service->area  , obs_data_get_string(settings, "area"));
-    service->auto_stop = obs_data_get_bool(settings, "auto_stop");
-
-    trim_cookie(service);
-    update_csrf_token(service);
+    cookie_entry *e = cookie_slot(jar, name, strlen(name));
+    return e && e->name ? e->value : NULL;
 }
 
-obs_properties_t *bilibili_properties(void *unused)
+const char *csrf_token(cookie_jar *jar)
 {
-    obs_properties_t *ppts = obs_properties_create();
+    const char *token = cookie_jar_get(jar, "bili_jct");
+    return token ? token : "";
+}
 
-    obs_properties_add_text(ppts, "cookie", "Cookie", OBS_TEXT_MULTILINE);
-    obs_properties_add_text(ppts, "area", "分区", OBS_TEXT_DEFAULT);
-    obs_properties_add_bool(ppts, "auto_stop", "停止推流时自动停播");
+/**
+ * "a=1; b=2" in one pass, line breaks left over from pasting are dropped
+ */
+void cookie_jar_parse(cookie_jar *jar, const char *cookie)
+{
+    char name[COOKIE_MAX_LEN];
+    char value[COOKIE_MAX_LEN];
+    size_t name_len = 0;
+    size_t value_len = 0;
+    bool in_value = false;
+    bool overflow = false;
 
-    return ppts;
+    cookie_jar_clear(jar);
+    for (const char *p = cookie; p; p++)
+    {
+        char c = *p;
+        if (c == '\r' || c == '\n')
+        {
+            continue;
+        }
+        if (c == ';' || c == '\0')
+        {
+            while (name_len && name[name_len - 1] == ' ')
+            {
+                name_len--;
+            }
+            while (value_len && value[value_len - 1] == ' ')
+            {
+                value_len--;
+            }
+            if (in_value && (overflow || !cookie_jar_set(jar, name, name_len, value, value_len)))
+            {
+                blog(LOG_WARNING, "cookie %.*s ignored", (int)name_len, name);
+            }
+            name_len = value_len = 0;
+            in_value = overflow = false;
+            if (c == '\0')
+            {
+                break;
+            }
+            continue;
+        }
+        if (!in_value && c == '=')
+        {
+            in_value = true;
+            continue;
+        }
+        char *buf = in_value ? value : name;
+        size_t *len = in_value ? &value_len : &name_len;
+        if (!*len && (c == ' ' || c == '\t'))
+        {
+            continue;
+        }
+        if (*len >= COOKIE_MAX_LEN - 1)
+        {
+            overflow = true;
+            continue;
+        }
+        buf[(*len)++] = c;
+    }
 }
 
-void bilibili_get_defaults(obs_data_t *settings)
+/**
+ * line: a Set-Cookie header value, only the leading name=value matters
+ */
+void cookie_jar_update(cookie_jar *jar, const char *line, size_t len)
 {
-    obs_data_set_default_bool(settings, "auto_stop", true);
+    const char *end = line + len;
+    while (line < end && (*line == ' ' || *line == '\t'))
+    {
+        line++;
+    }
+    const char *eq = memchr(line, '=', end - line);
+    if (!eq)
+    {
+        return;
+    }
+    const char *value = eq + 1;
+    const char *value_end = value;
+    while (value_end < end && *value_end != ';' && *value_end != '\r' && *value_end != '\n')
+    {
+        value_end++;
+    }
+    if (cookie_jar_set(jar, line, eq - line, value, value_end - value))
+    {
+        blog(LOG_DEBUG, "cookie %.*s refreshed", (int)(eq - line), line);
+    }
 }
 
-size_t writefunc(void *ptr, size_t size, size_t nmemb, bilibili_service *s)
+/**
+ * replace what curl's cookie engine holds with the jar
+ */
+void cookie_jar_load(CURL *curl, cookie_jar *jar)
 {
-    size_t realsize = size * nmemb;
-    simple_buffer *buf = &s->buffer;
-    buf->buf = brealloc(buf->buf, buf->size + realsize + 1);
-    
-    if (buf->buf == NULL) {
-        blog(LOG_ERROR, "not enough memory (realloc returned NULL)");
-        return 0;
+    struct dstr line = {0};
+    curl_easy_setopt(curl, CURLOPT_COOKIELIST, "ALL");
+    for (size_t i = 0; i < COOKIE_SLOTS; i++)
+    {
+        cookie_entry *e = &jar->slots[i];
+        if (e->name)
+        {
+            dstr_printf(&line, "Set-Cookie: %s=%s; domain=" COOKIE_DOMAIN "; path=/", e->name, e->value);
+            curl_easy_setopt(curl, CURLOPT_COOKIELIST, line.array);
+        }
     }
+    dstr_free(&line);
+}
 
-    memcpy(&(buf->buf[buf->size]), ptr, realsize);
-    buf->size += realsize;
-    buf->buf[buf->size] = 0;
-    return realsize;
+ingest *find_ingest(bilibili_service *s, const char *url)
+{
+    for (size_t i = 0; i < s->ingests.num; i++)
+    {
+        if (strcmp(s->ingests.array[i].url, url) == 0)
+        {
+            return &s->ingests.array[i];
+        }
+    }
+    return NULL;
 }
 
-void reset_buffer(simple_buffer *buf)
+void add_ingest(bilibili_service *s, const char *url)
 {
-    if (buf->buf)
+    if (!url || !*url || find_ingest(s, url) || s->ingests.num >= INGEST_MAX)
     {
-        bfree(buf->buf);
+        return;
     }
-    buf->size = 0;
-    buf->buf = bmalloc(1);
+    ingest i = {bstrdup(url), -1.0, 0};
+    da_push_back(s->ingests, &i);
 }
 
-bool get_url(bilibili_service *s, const char* url)
+/**
+ * keep the scores of candidates that are still configured
+ */
+void update_ingests(bilibili_service *s, obs_data_t *settings)
 {
-    bool result = false;
-    CURL *curl;
-    CURLcode res;
-    curl = curl_easy_init();
-    if (curl)
+    obs_data_array_t *list = obs_data_get_array(settings, "ingests");
+    size_t count = obs_data_array_count(list);
+    for (size_t i = s->ingests.num; i > 0; i--)
     {
-        reset_buffer(&s->buffer);
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_COOKIE, s->cookie);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, s);
-        res = curl_easy_perform(curl);
-        if(res == CURLE_OK)
+        ingest *in = &s->ingests.array[i - 1];
+        bool keep = s->addr && strcmp(in->url, s->addr) == 0;
+        for (size_t j = 0; j < count && !keep; j++)
+        {
+            obs_data_t *item = obs_data_array_item(list, j);
+            keep = strcmp(in->url, obs_data_get_string(item, "value")) == 0;
+            obs_data_release(item);
+        }
+        if (!keep)
         {
-            result = true;
+            bfree(in->url);
+            da_erase(s->ingests, i - 1);
         }
-        curl_easy_cleanup(curl);
     }
-    return result;
+    for (size_t j = 0; j < count; j++)
+    {
+        obs_data_t *item = obs_data_array_item(list, j);
+        add_ingest(s, obs_data_get_string(item, "value"));
+        obs_data_release(item);
+    }
+    obs_data_array_release(list);
 }
 
-int32_t get_area_id_in_group(obs_data_t *group, const char *name)
+void sim_room_free(sim_room *r)
 {
-    obs_data_array_t *list = obs_data_get_array(group, "list");
-    if (list)
+    bfree(r->cookie);
+    cookie_jar_clear(&r->jar);
+    http_conn_free(&r->conn);
+}
+
+/**
+ * keep room ids of accounts that are still configured
+ */
+void update_sim_rooms(bilibili_service *s, obs_data_t *settings)
+{
+    obs_data_array_t *list = obs_data_get_array(settings, "simulcast");
+    size_t count = obs_data_array_count(list);
+    char **cookies = bzalloc((count + 1) * sizeof(char *));
+    for (size_t j = 0; j < count; j++)
+    {
+        obs_data_t *item = obs_data_array_item(list, j);
+        cookies[j] = bstrdup(obs_data_get_string(item, "value"));
+        obs_data_release(item);
+    }
+    obs_data_array_release(list);
+
+    for (size_t i = s->sims.num; i > 0; i--)
     {
-        size_t size = obs_data_array_count(list);
-        for (int i = 0; i < size; i++)
+        sim_room *r = &s->sims.array[i - 1];
+        bool keep = false;
+        for (size_t j = 0; j < count && !keep; j++)
         {
-            obs_data_t *item = obs_data_array_item(list, i);
-            if (item)
+            keep = cookies[j] && strcmp(r->cookie, cookies[j]) == 0;
+            if (keep)
             {
-                const char *n = obs_data_get_string(item, "name");
-                if (strcmp(n, name) == 0)
-                {
-                    const char *id_str = obs_data_get_string(item, "id");
-                    if (id_str)
-                    {
-                        return atoi(id_str);
-                    }
-                }
-                obs_data_release(item);
+                bfree(cookies[j]);
+                cookies[j] = NULL;
             }
         }
-        obs_data_array_release(list);
+        if (!keep)
+        {
+            sim_room_free(r);
+            da_erase(s->sims, i - 1);
+        }
     }
-    return -1;
+    for (size_t j = 0; j < count; j++)
+    {
+        sim_room r = {0};
+        r.cookie = cookies[j];
+        if (!r.cookie || !*r.cookie)
+        {
+            bfree(r.cookie);
+            continue;
+        }
+        cookie_jar_parse(&r.jar, r.cookie);
+        if (!*csrf_token(&r.jar))
+        {
+            blog(LOG_ERROR, "simulcast cookie without bili_jct ignored");
+            sim_room_free(&r);
+            continue;
+        }
+        da_push_back(s->sims, &r);
+    }
+    bfree(cookies);
 }
 
-bool get_area_id(bilibili_service *s)
+void queue_task(bilibili_service *s, bilibili_task task)
 {
-    if (get_url(s, "https://api.live.bilibili.com/room/v1/Area/getList"))
+    if (!s->worker_valid)
     {
-        obs_data_t *res = obs_data_create_from_json(s->buffer.buf);
-        if (res)
-        {
-            obs_data_array_t *data = obs_data_get_array(res, "data");
-            if (data)
-            {
-                size_t size = obs_data_array_count(data);
-                for (int i = 0; i < size; i++)
-                {
-                    obs_data_t *group = obs_data_array_item(data, i);
-                    if (group)
-                    {
-                        int32_t id = get_area_id_in_group(group, s->area);
-                        if (id != -1)
-                        {
-                            s->area_id = id;
-                            return true;
-                        }
-                        obs_data_release(group);
-                    }
-                }
-                obs_data_array_release(data);
-            }
-            obs_data_release(res);
-        }
+        return;
     }
-    return false;
+    pthread_mutex_lock(&s->task_mutex);
+    s->tasks |= task;
+    pthread_mutex_unlock(&s->task_mutex);
+    os_event_signal(s->task_event);
 }
 
-bool get_room_id(bilibili_service *s)
+/**
+ * only called by the worker, or before there is one
+ */
+void apply_settings(bilibili_service *service, obs_data_t *settings)
 {
-    if (s->room_id)
+    char *old_cookie = service->cookie;
+    service->cookie = NULL;
+    service->area_id = -1;
+
+    my_strdup(&service->cookie, obs_data_get_string(settings, "cookie"));
+    my_strdup(&service->area  , obs_data_get_string(settings, "area"));
+
+    cookie_jar_parse(&service->jar, service->cookie);
+    if (!*csrf_token(&service->jar))
     {
-        return true;
+        blog(LOG_ERROR, "cookie has no bili_jct, csrf token missing");
     }
-    if (get_url(s, "https://api.live.bilibili.com/i/api/liveinfo"))
+    update_ingests(service, settings);
+    update_sim_rooms(service, settings);
+    // same account: keep room id and the last known-good credentials
+    if (!old_cookie || strcmp(old_cookie, service->cookie) != 0)
     {
-        obs_data_t *res = obs_data_create_from_json(s->buffer.buf);
-        if (obs_data_get_int(res, "code") == 0)
-        {
-            obs_data_t *data = obs_data_get_obj(res, "data");
-            s->room_id = obs_data_get_int(data, "roomid");
-            obs_data_release(data);
-            return !!s->room_id;
-        }
-        obs_data_release(res);
+        reset_account(service);
     }
-    return false;
+    bfree(old_cookie);
 }
 
-void stop_live(bilibili_service *s)
+/**
+ * hands the settings to the worker, saving them never waits for a request
+ * in flight
+ */
+void bilibili_update(void *data, obs_data_t *settings)
 {
-    CURL *curl;
-    curl = curl_easy_init();
-    if (curl)
+    bilibili_service *service = data;
+    service->auto_stop = obs_data_get_bool(settings, "auto_stop");
+    if (!service->worker_valid)
     {
-        char post_fields[1024];
-        sprintf(post_fields, "room_id=%lld&platform=pc&csrf_token=%s", s->room_id, s->csrf_token);
-        CURLcode res;
-        reset_buffer(&s->buffer);
-        curl_easy_setopt(curl, CURLOPT_URL, "http://api.live.bilibili.com/room/v1/Room/stopLive");
-        curl_easy_setopt(curl, CURLOPT_COOKIE, s->cookie);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, s);
+        apply_settings(service, settings);
+        return;
+    }
 
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_fields);
-        res = curl_easy_perform(curl);
-        if(res == CURLE_OK)
-        {
-            //
-        }
-        curl_easy_cleanup(curl);
+    obs_data_addref(settings);
+    pthread_mutex_lock(&service->mutex);
+    obs_data_t *old = service->pending_settings;
+    service->pending_settings = settings;
+    pthread_mutex_unlock(&service->mutex);
+    obs_data_release(old);
+
+    // the settings dialog also creates throwaway instances, they never prefetch
+    pthread_mutex_lock(&service->task_mutex);
+    service->prefetch_pending = true;
+    pthread_mutex_unlock(&service->task_mutex);
+    if (obs_frontend_get_streaming_service() == service->context)
+    {
+        queue_prefetch(service);
     }
 }
 
-bool start_live(bilibili_service *s)
+void queue_prefetch(bilibili_service *s)
 {
-    if (!get_area_id(s)) return false;
-    if (!get_room_id(s)) return false;
-    bool result = false;
-    CURL *curl;
-    curl = curl_easy_init();
-    if (curl)
+    pthread_mutex_lock(&s->task_mutex);
+    bool pending = s->prefetch_pending;
+    s->prefetch_pending = false;
+    pthread_mutex_unlock(&s->task_mutex);
+    if (pending)
     {
-        char post_fields[1024];
-        sprintf(post_fields, "room_id=%lld&platform=pc&area_v2=%d&csrf_token=%s", s->room_id, s->area_id, s->csrf_token);
-        CURLcode res;
-        reset_buffer(&s->buffer);
-        curl_easy_setopt(curl, CURLOPT_URL, "http://api.live.bilibili.com/room/v1/Room/startLive");
-        curl_easy_setopt(curl, CURLOPT_COOKIE, s->cookie);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, s);
+        queue_task(s, task_prepare | task_probe);
+    }
+}
 
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_fields);
-        res = curl_easy_perform(curl);
-        if(res == CURLE_OK)
-        {
-            result = true;
-        }
-        curl_easy_cleanup(curl);
+obs_properties_t *bilibili_properties(void *unused)
+{
+    obs_properties_t *ppts = obs_properties_create();
+
+    obs_properties_add_text(ppts, "cookie", "Cookie", OBS_TEXT_MULTILINE);
+    obs_property_t *area = obs_properties_add_list(ppts, "area", "分区", OBS_COMBO_TYPE_EDITABLE, OBS_COMBO_FORMAT_STRING);
+    area_index_fill_list(area);
+    obs_properties_add_bool(ppts, "auto_stop", "停止推流时自动停播");
+    obs_properties_add_editable_list(ppts, "ingests", "备选推流地址", OBS_EDITABLE_LIST_TYPE_STRINGS, NULL, NULL);
+    obs_properties_add_editable_list(ppts, "simulcast", "同时开播的其他账号 Cookie", OBS_EDITABLE_LIST_TYPE_STRINGS, NULL, NULL);
+
+    return ppts;
+}
+
+void bilibili_get_defaults(obs_data_t *settings)
+{
+    obs_data_set_default_bool(settings, "auto_stop", true);
+}
+
+/**
+ * grows geometrically, limit: 0 for unbounded
+ */
+bool buffer_append(simple_buffer *buf, const char *data, size_t len, size_t limit)
+{
+    size_t need = buf->size + len + 1;
+    if (limit && need > limit)
+    {
+        return false;
     }
-    if (result)
+    if (need > buf->capacity)
     {
-        obs_data_t *res = obs_data_create_from_json(s->buffer.buf);
-        obs_data_t *data = obs_data_get_obj(res, "data");
-        obs_data_t *rtmp = obs_data_get_obj(data, "rtmp");
-        my_strdup(&(s->addr), obs_data_get_string(rtmp, "addr"));
-        my_strdup(&(s->code), obs_data_get_string(rtmp, "code"));
-        obs_data_release(data);
-        obs_data_release(rtmp);
-        obs_data_release(res);
-        blog(LOG_DEBUG, "p %p %p %p\n%s\n%s\n%s", res, data, rtmp, s->addr, s->code, s->buffer.buf);
+        size_t capacity = buf->capacity ? buf->capacity : 64;
+        while (capacity < need)
+        {
+            capacity *= 2;
+        }
+        buf->buf = brealloc(buf->buf, capacity);
+        buf->capacity = capacity;
     }
-    else
+    memcpy(buf->buf + buf->size, data, len);
+    buf->size += len;
+    buf->buf[buf->size] = 0;
+    return true;
+}
+
+void reset_buffer(simple_buffer *buf)
+{
+    if (!buf->buf)
     {
-        blog(LOG_ERROR, "failed to post startLive");
+        buf->buf = bmalloc(64);
+        buf->capacity = 64;
     }
-    return result;
+    buf->size = 0;
+    buf->buf[0] = 0;
 }
 
-void bilibili_frontend_stop(enum obs_frontend_event event, void *data)
+void *arena_alloc(arena *a, size_t size)
 {
-    bilibili_service *s = data;
-    if (event == OBS_FRONTEND_EVENT_STREAMING_STOPPED)
+    // keep every allocation pointer aligned
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    arena_block *b = a->head;
+    if (!b || b->used + size > b->size)
     {
-        obs_frontend_remove_event_callback(bilibili_frontend_stop, data);
-        stop_live(s);
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        b = bmalloc(sizeof(arena_block) + block_size);
+        b->next = a->head;
+        b->used = 0;
+        b->size = block_size;
+        a->head = b;
     }
+    void *ptr = b->data + b->used;
+    b->used += size;
+    return ptr;
 }
 
-void register_stop_streaming(bilibili_service *s)
+char *arena_strdup(arena *a, const char *str)
+{
+    size_t len = strlen(str);
+    char *dst = arena_alloc(a, len + 1);
+    memcpy(dst, str, len + 1);
+    return dst;
+}
+
+void arena_free(arena *a)
 {
-    if (s->auto_stop)
+    while (a->head)
     {
-        obs_frontend_add_event_callback(bilibili_frontend_stop, s);
+        arena_block *next = a->head->next;
+        bfree(a->head);
+        a->head = next;
     }
 }
 
-const char *bilibili_url(void *data)
+void json_stream_init(json_stream *j, const char **paths, size_t path_count, json_value_cb cb, void *param)
 {
-    bilibili_service *s = data;
-    start_live(s);
-    register_stop_streaming(s);
-    blog(LOG_DEBUG, "bilibili url %s", s->addr);
-    return s->addr;
+    memset(j, 0, sizeof(*j));
+    j->paths = paths;
+    j->path_count = path_count;
+    j->cb = cb;
+    j->param = param;
+    j->state = json_value;
+    reset_buffer(&j->token);
 }
 
-const char *bilibili_key(void *data)
+/**
+ * start over on a new document, e.g. when a request is retried
+ */
+void json_stream_reset(json_stream *j)
 {
-    bilibili_service *s = data;
-    blog(LOG_DEBUG, "bilibili key %s", s->code);
-    return s->code;
+    simple_buffer token = j->token;
+    j->token.buf = NULL;
+    json_stream_init(j, j->paths, j->path_count, j->cb, j->param);
+    bfree(j->token.buf);
+    j->token = token;
+    reset_buffer(&j->token);
 }
 
-struct obs_service_info my_service = {
-    .id             = "bilibili_service",
-    .get_name       = bilibili_name,
-    .create         = bilibili_create,
-    .destroy        = bilibili_destroy,
-    .update         = bilibili_update,
-    .get_properties = bilibili_properties,
-    .get_defaults   = bilibili_get_defaults,
-    .get_url        = bilibili_url,
-    .get_key        = bilibili_key,
-};
+void json_stream_free(json_stream *j)
+{
+    bfree(j->token.buf);
+    j->token.buf = NULL;
+}
 
-bool obs_module_load(void)
+bool json_path_wanted(json_stream *j, size_t *index)
 {
-    obs_register_service(&my_service);
-    return true;
+    for (size_t i = 0; i < j->path_count; i++)
+    {
+        if (strcmp(j->path, j->paths[i]) == 0)
+        {
+            *index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void json_token_append(json_stream *j, const char *data, size_t len)
+{
+    if (j->capture && !buffer_append(&j->token, data, len, JSON_MAX_TOKEN))
+    {
+        j->error = true;
+    }
+}
+
+void json_path_set(json_stream *j, size_t len, const char *suffix)
+{
+    size_t n = strlen(suffix);
+    if (len + n >= JSON_MAX_PATH)
+    {
+        j->error = true;
+        return;
+    }
+    memcpy(j->path + len, suffix, n + 1);
+    j->path_len = len + n;
+}
+
+void json_begin_token(json_stream *j, bool in_key)
+{
+    size_t index;
+    j->in_key = in_key;
+    j->capture = in_key || json_path_wanted(j, &index);
+    reset_buffer(&j->token);
+}
+
+void json_end_value(json_stream *j)
+{
+    j->state = j->depth ? json_after_value : json_done;
+}
+
+void json_emit(json_stream *j)
+{
+    size_t index;
+    if (j->capture && json_path_wanted(j, &index))
+    {
+        j->cb(j->param, index, j->token.buf);
+    }
+}
+
+void json_push(json_stream *j, char c)
+{
+    if (j->depth >= JSON_MAX_DEPTH)
+    {
+        j->error = true;
+        return;
+    }
+    j->stack[j->depth] = c;
+    j->base[j->depth] = j->path_len;
+    j->depth++;
+    if (c == '[')
+    {
+        json_path_set(j, j->path_len, "[]");
+        j->state = json_value_or_end;
+    }
+    else
+    {
+        j->state = json_key_or_end;
+    }
+}
+
+void json_pop(json_stream *j, char c)
+{
+    size_t index;
+    char open = c == '}' ? '{' : '[';
+    if (!j->depth || j->stack[j->depth - 1] != open)
+    {
+        j->error = true;
+        return;
+    }
+    j->depth--;
+    json_path_set(j, j->base[j->depth], "");
+    if (json_path_wanted(j, &index))
+    {
+        j->cb(j->param, index, NULL);
+    }
+    json_end_value(j);
+}
+
+void json_end_key(json_stream *j)
+{
+    size_t base = j->base[j->depth - 1];
+    json_path_set(j, base, base ? "." : "");
+    json_path_set(j, j->path_len, j->token.buf);
+    j->state = json_colon;
+}
+
+void json_append_utf8(json_stream *j, uint32_t cp)
+{
+    char out[4];
+    size_t n;
+    if (cp < 0x80)
+    {
+        out[0] = (char)cp;
+        n = 1;
+    }
+    else if (cp < 0x800)
+    {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        n = 2;
+    }
+    else if (cp < 0x10000)
+    {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        n = 3;
+    }
+    else
+    {
+        out[0] = (char)(0xF0 | (cp >> 18));
+        out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[3] = (char)(0x80 | (cp & 0x3F));
+        n = 4;
+    }
+    json_token_append(j, out, n);
+}
+
+void json_unicode_done(json_stream *j)
+{
+    uint32_t cp = j->unicode;
+    if (cp >= 0xD800 && cp < 0xDC00)
+    {
+        j->high_surrogate = cp;
+        return;
+    }
+    if (cp >= 0xDC00 && cp < 0xE000 && j->high_surrogate)
+    {
+        cp = 0x10000 + ((j->high_surrogate - 0xD800) << 10) + (cp - 0xDC00);
+    }
+    j->high_surrogate = 0;
+    json_append_utf8(j, cp);
+}
+
+bool is_json_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/**
+ * return: false once the document is malformed or exceeds the limits
+ */
+bool json_stream_feed(json_stream *j, const char *data, size_t len)
+{
+    for (size_t i = 0; i < len && !j->error; i++)
+    {
+        char c = data[i];
+        switch (j->state)
+        {
+            case json_value_or_end:
+                if (c == ']')
+                {
+                    json_pop(j, c);
+                    break;
+                }
+                /* fall through */
+            case json_value:
+                if (is_json_space(c))
+                {
+                    break;
+                }
+                if (c == '{' || c == '[')
+                {
+                    json_push(j, c);
+                }
+                else if (c == '"')
+                {
+                    json_begin_token(j, false);
+                    j->state = json_string;
+                }
+                else if (c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' || c == 'n')
+                {
+                    json_begin_token(j, false);
+                    json_token_append(j, &c, 1);
+                    j->state = json_literal;
+                }
+                else
+                {
+                    j->error = true;
+                }
+                break;
+            case json_key_or_end:
+                if (c == '}')
+                {
+                    json_pop(j, c);
+                    break;
+                }
+                /* fall through */
+            case json_key:
+                if (is_json_space(c))
+                {
+                    break;
+                }
+                if (c == '"')
+                {
+                    json_begin_token(j, true);
+                    j->state = json_string;
+                }
+                else
+                {
+                    j->error = true;
+                }
+                break;
+            case json_colon:
+                if (c == ':')
+                {
+                    j->state = json_value;
+                }
+                else if (!is_json_space(c))
+                {
+                    j->error = true;
+                }
+                break;
+            case json_string:
+                if (c == '\\')
+                {
+                    j->state = json_escape;
+                }
+                else if (c == '"')
+                {
+                    if (j->in_key)
+                    {
+                        json_end_key(j);
+                    }
+                    else
+                    {
+                        json_emit(j);
+                        json_end_value(j);
+                    }
+                }
+                else
+                {
+                    json_token_append(j, &c, 1);
+                }
+                break;
+            case json_escape:
+            {
+                char e = c;
+                j->state = json_string;
+                switch (c)
+                {
+                    case 'b': e = '\b'; break;
+                    case 'f': e = '\f'; break;
+                    case 'n': e = '\n'; break;
+                    case 'r': e = '\r'; break;
+                    case 't': e = '\t'; break;
+                    case 'u':
+                        j->unicode = 0;
+                        j->unicode_digits = 0;
+                        j->state = json_unicode;
+                        break;
+                }
+                if (c != 'u')
+                {
+                    json_token_append(j, &e, 1);
+                }
+                break;
+            }
+            case json_unicode:
+            {
+                int v;
+                if (c >= '0' && c <= '9') v = c - '0';
+                else if (c >= 'a' && c <= 'f') v = c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F') v = c - 'A' + 10;
+                else
+                {
+                    j->error = true;
+                    break;
+                }
+                j->unicode = (j->unicode << 4) | v;
+                if (++j->unicode_digits == 4)
+                {
+                    json_unicode_done(j);
+                    j->state = json_string;
+                }
+                break;
+            }
+            case json_literal:
+                if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '.' || c == '+' || c == '-' || c == 'E')
+                {
+                    json_token_append(j, &c, 1);
+                    break;
+                }
+                json_emit(j);
+                json_end_value(j);
+                // the delimiter still has to be handled
+                i--;
+                break;
+            case json_after_value:
+                if (is_json_space(c))
+                {
+                    break;
+                }
+                if (c == ',')
+                {
+                    j->state = j->stack[j->depth - 1] == '{' ? json_key : json_value;
+                }
+                else if (c == '}' || c == ']')
+                {
+                    json_pop(j, c);
+                }
+                else
+                {
+                    j->error = true;
+                }
+                break;
+            case json_done:
+                if (!is_json_space(c))
+                {
+                    j->error = true;
+                }
+                break;
+        }
+    }
+    return !j->error;
+}
+
+/**
+ * return: whether a whole document was read
+ */
+bool json_stream_finish(json_stream *j)
+{
+    if (j->state == json_literal && !j->depth)
+    {
+        json_emit(j);
+        j->state = json_done;
+    }
+    return !j->error && j->state == json_done;
+}
+
+/**
+ * param: char *[] with one slot per path, the last value wins
+ */
+void json_capture_fields(void *param, size_t index, const char *value)
+{
+    char **fields = param;
+    if (value)
+    {
+        my_strdup(&fields[index], value);
+    }
+}
+
+void json_free_fields(char **fields, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        bfree(fields[i]);
+        fields[i] = NULL;
+    }
+}
+
+size_t writefunc(void *ptr, size_t size, size_t nmemb, http_conn *c)
+{
+    size_t realsize = size * nmemb;
+    http_conn *owner = c->primary ? c->primary : c;
+    // a hedged pair: whoever delivers the body first owns the parser
+    if (!owner->winner)
+    {
+        owner->winner = c;
+    }
+    if (owner->winner != c)
+    {
+        return 0;
+    }
+    c = owner;
+    c->decoded += realsize;
+    if (c->json)
+    {
+        return json_stream_feed(c->json, ptr, realsize) ? realsize : 0;
+    }
+    if (!buffer_append(&c->buffer, ptr, realsize, 0))
+    {
+        return 0;
+    }
+    return realsize;
+}
+
+void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+    pthread_mutex_lock(&share_mutex[data]);
+}
+
+void share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+    pthread_mutex_unlock(&share_mutex[data]);
+}
+
+void init_curl_share(void)
+{
+    curl_global_init(CURL_GLOBAL_ALL);
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    {
+        pthread_mutex_init(&share_mutex[i], NULL);
+    }
+    curl_share = curl_share_init();
+    if (!curl_share)
+    {
+        return;
+    }
+    curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, share_lock);
+    curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    // older libcurl can not share connections, each handle keeps its own
+    if (curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) != CURLSHE_OK)
+    {
+        blog(LOG_DEBUG, "curl connection sharing not supported");
+    }
+}
+
+void free_curl_share(void)
+{
+    if (curl_share)
+    {
+        curl_share_cleanup(curl_share);
+        curl_share = NULL;
+    }
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    {
+        pthread_mutex_destroy(&share_mutex[i]);
+    }
+    curl_global_cleanup();
+}
+
+void copy_header(char **dst, const char *name, const char *line, size_t len)
+{
+    size_t n = strlen(name);
+    if (len <= n || astrcmpi_n(line, name, n) != 0)
+    {
+        return;
+    }
+    const char *begin = line + n;
+    const char *end = line + len;
+    while (begin < end && (*begin == ' ' || *begin == '\t'))
+    {
+        begin++;
+    }
+    while (end > begin && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' '))
+    {
+        end--;
+    }
+    bfree(*dst);
+    *dst = bstrdup_n(begin, end - begin);
+}
+
+size_t headerfunc(char *ptr, size_t size, size_t nitems, http_conn *c)
+{
+    size_t len = size * nitems;
+    copy_header(&c->etag, "ETag:", ptr, len);
+    copy_header(&c->last_modified, "Last-Modified:", ptr, len);
+    if (c->jar && len > 11 && astrcmpi_n(ptr, "Set-Cookie:", 11) == 0)
+    {
+        cookie_jar_update(c->jar, ptr + 11, len - 11);
+    }
+    return len;
+}
+
+/**
+ * curl_easy_reset keeps open connections and caches of the handle
+ */
+CURL *client_handle(bilibili_service *s, http_conn *c)
+{
+    if (c->curl)
+    {
+        curl_easy_reset(c->curl);
+    }
+    else
+    {
+        c->curl = curl_easy_init();
+        if (!c->curl)
+        {
+            return NULL;
+        }
+    }
+    CURL *curl = c->curl;
+    if (curl_share)
+    {
+        curl_easy_setopt(curl, CURLOPT_SHARE, curl_share);
+    }
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)API_CONNECT_TIMEOUT_MS);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)API_TIMEOUT_MS);
+    // every encoding curl was built with, decoded before writefunc sees it
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    if (!c->jar)
+    {
+        c->jar = &s->jar;
+    }
+    // an empty cookie file turns the engine on, curl_easy_reset keeps its cookies
+    curl_easy_setopt(curl, CURLOPT_COOKIEFILE, "");
+    if (c->jar_version != c->jar->version)
+    {
+        cookie_jar_load(curl, c->jar);
+        c->jar_version = c->jar->version;
+    }
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, c);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, headerfunc);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, c);
+    return curl;
+}
+
+void http_conn_free(http_conn *c)
+{
+    if (c->curl)
+    {
+        curl_easy_cleanup(c->curl);
+    }
+    curl_slist_free_all(c->headers);
+    bfree(c->buffer.buf);
+    bfree(c->etag);
+    bfree(c->last_modified);
+    dstr_free(&c->url);
+    if (c->hedge)
+    {
+        http_conn_free(c->hedge);
+        bfree(c->hedge);
+    }
+}
+
+void latency_record(endpoint ep, double ms)
+{
+    pthread_mutex_lock(&metrics_mutex);
+    latency_window *w = &latencies[ep];
+    w->samples[w->count++ % LATENCY_WINDOW] = ms;
+    pthread_mutex_unlock(&metrics_mutex);
+}
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * return: p95 of the recent calls in ms, < 0 while there are too few
+ */
+double latency_p95(endpoint ep)
+{
+    double samples[LATENCY_WINDOW];
+    size_t n;
+    pthread_mutex_lock(&metrics_mutex);
+    latency_window *w = &latencies[ep];
+    n = w->count < LATENCY_WINDOW ? w->count : LATENCY_WINDOW;
+    memcpy(samples, w->samples, n * sizeof(double));
+    pthread_mutex_unlock(&metrics_mutex);
+    if (n < HEDGE_MIN_SAMPLES)
+    {
+        return -1;
+    }
+    qsort(samples, n, sizeof(double), compare_double);
+    return samples[(n * 95 - 1) / 100];
+}
+
+int histogram_bucket(double ms)
+{
+    int i = 0;
+    while (i < HISTOGRAM_BUCKETS - 1 && ms > histogram_bounds[i])
+    {
+        i++;
+    }
+    return i;
+}
+
+/**
+ * one finished transfer, hedges and retries count as requests of their own
+ */
+void metrics_record(endpoint ep, CURL *curl, CURLcode result, uint64_t decoded)
+{
+    double t[phase_count] = {0};
+    double dns = 0, connect = 0, tls = 0, ttfb = 0, total = 0;
+    uint64_t size = 0;
+    long status = 0, connects = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &tls);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &ttfb);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t downloaded = 0;
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+#else
+    // the bundled 7.52 headers predate the _T variant
+    double downloaded = 0;
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &downloaded);
+#endif
+    size = downloaded > 0 ? (uint64_t)downloaded : 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    // curl reports points in time since the start, turn them into phases
+    double ready = tls > 0 ? tls : connect;
+    t[phase_dns] = dns * 1000.0;
+    t[phase_connect] = (connect - dns) * 1000.0;
+    t[phase_tls] = (tls - connect) * 1000.0;
+    t[phase_ttfb] = (ttfb - ready) * 1000.0;
+    t[phase_total] = total * 1000.0;
+
+    uint64_t now = os_gettime_ns() / 1000000000;
+    pthread_mutex_lock(&metrics_mutex);
+    endpoint_metrics *m = &metrics[ep];
+    if (now - m->started >= METRICS_WINDOW_SEC)
+    {
+        m->window[1] = now - m->started < 2 * METRICS_WINDOW_SEC ? m->window[0] : (metrics_window){0};
+        memset(&m->window[0], 0, sizeof(metrics_window));
+        m->started = now;
+    }
+    metrics_window *w = &m->window[0];
+    w->requests++;
+    if (result != CURLE_OK && result < CURL_LAST)
+    {
+        w->curl_errors[result]++;
+    }
+    w->http[status >= 100 && status < 600 ? status / 100 : 0]++;
+    w->bytes += size;
+    w->decoded_bytes += decoded;
+    if (size > w->max_bytes)
+    {
+        w->max_bytes = size;
+    }
+    if (result == CURLE_OK)
+    {
+        // a reused connection has no dns, connect or tls phase
+        for (int i = connects > 0 ? 0 : phase_ttfb; i < phase_count; i++)
+        {
+            if (i != phase_tls || tls > 0)
+            {
+                w->phases[i][histogram_bucket(t[i])]++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&metrics_mutex);
+}
+
+/**
+ * return: upper bound of the bucket holding quantile q, HUGE_VAL past the
+ * last bound, < 0 when empty
+ */
+double histogram_quantile(const uint32_t *buckets, double q)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        total += buckets[i];
+    }
+    if (!total)
+    {
+        return -1;
+    }
+    uint64_t rank = (uint64_t)(q * total + 0.5);
+    rank = rank ? rank : 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS - 1; i++)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+        {
+            return histogram_bounds[i];
+        }
+    }
+    return HUGE_VAL;
+}
+
+/**
+ * long format: endpoint,metric,key,value
+ */
+void metrics_dump(void)
+{
+    metrics_window all[endpoint_count];
+    pthread_mutex_lock(&metrics_mutex);
+    for (int e = 0; e < endpoint_count; e++)
+    {
+        metrics_window *a = &metrics[e].window[0];
+        metrics_window *b = &metrics[e].window[1];
+        metrics_window *w = &all[e];
+        w->requests = a->requests + b->requests;
+        for (int i = 0; i < CURL_LAST; i++)
+        {
+            w->curl_errors[i] = a->curl_errors[i] + b->curl_errors[i];
+        }
+        for (int i = 0; i < 6; i++)
+        {
+            w->http[i] = a->http[i] + b->http[i];
+        }
+        w->bytes = a->bytes + b->bytes;
+        w->decoded_bytes = a->decoded_bytes + b->decoded_bytes;
+        w->max_bytes = a->max_bytes > b->max_bytes ? a->max_bytes : b->max_bytes;
+        for (int p = 0; p < phase_count; p++)
+        {
+            for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+            {
+                w->phases[p][i] = a->phases[p][i] + b->phases[p][i];
+            }
+        }
+    }
+    pthread_mutex_unlock(&metrics_mutex);
+
+    char *dir = obs_module_config_path("");
+    char *path = obs_module_config_path(METRICS_FILE);
+    os_mkdirs(dir);
+    FILE *f = os_fopen(path, "w");
+    if (!f)
+    {
+        blog(LOG_WARNING, "failed to write %s", path);
+        bfree(path);
+        bfree(dir);
+        return;
+    }
+    fprintf(f, "endpoint,metric,key,value\n");
+    for (int e = 0; e < endpoint_count; e++)
+    {
+        const char *name = endpoints[e].name;
+        metrics_window *w = &all[e];
+        fprintf(f, "%s,requests,,%u\n", name, w->requests);
+        fprintf(f, "%s,bytes,sum,%llu\n", name, (unsigned long long)w->bytes);
+        fprintf(f, "%s,bytes,max,%llu\n", name, (unsigned long long)w->max_bytes);
+        fprintf(f, "%s,bytes,decoded,%llu\n", name, (unsigned long long)w->decoded_bytes);
+        for (int i = 0; i < 6; i++)
+        {
+            if (w->http[i])
+            {
+                fprintf(f, i ? "%s,http,%dxx,%u\n" : "%s,http,none,%u\n", name, i, w->http[i]);
+            }
+        }
+        for (int i = 0; i < CURL_LAST; i++)
+        {
+            if (w->curl_errors[i])
+            {
+                fprintf(f, "%s,curl_error,%d %s,%u\n", name, i, curl_easy_strerror((CURLcode)i), w->curl_errors[i]);
+            }
+        }
+        for (int p = 0; p < phase_count; p++)
+        {
+            for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+            {
+                if (i < HISTOGRAM_BUCKETS - 1)
+                {
+                    fprintf(f, "%s,%s_ms,le_%g,%u\n", name, phase_names[p], histogram_bounds[i], w->phases[p][i]);
+                }
+                else
+                {
+                    fprintf(f, "%s,%s_ms,inf,%u\n", name, phase_names[p], w->phases[p][i]);
+                }
+            }
+        }
+        // bucket bounds, good enough to compare runs
+        const double quantiles[] = {0.5, 0.99};
+        const char *quantile_names[] = {"p50", "p99"};
+        for (int i = 0; i < 2; i++)
+        {
+            double ms = histogram_quantile(w->phases[phase_total], quantiles[i]);
+            if (ms >= 0)
+            {
+                fprintf(f, "%s,total_ms,%s,%g\n", name, quantile_names[i], ms);
+            }
+        }
+    }
+    fclose(f);
+    bfree(path);
+    bfree(dir);
+}
+
+/**
+ * xorshift, one state per thread so concurrent callers never share it
+ */
+uint32_t random_u32(void)
+{
+    static THREAD_LOCAL uint32_t state = 0;
+    // threads seeded in the same tick still start apart
+    uint32_t x = state ? state : ((uint32_t)os_gettime_ns() ^ (uint32_t)(uintptr_t)&state) | 1;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    state = x;
+    return x;
+}
+
+/**
+ * exponential with +-50% jitter
+ */
+uint32_t backoff_ms(int attempt)
+{
+    uint32_t base = API_BACKOFF_MS << attempt;
+    return base / 2 + random_u32() % (base + 1);
+}
+
+void http_reset_response(http_conn *c)
+{
+    c->result = CURLE_FAILED_INIT;
+    c->status = 0;
+    c->decoded = 0;
+    c->winner = NULL;
+    bfree(c->etag);
+    bfree(c->last_modified);
+    c->etag = NULL;
+    c->last_modified = NULL;
+    reset_buffer(&c->buffer);
+    if (c->json)
+    {
+        json_stream_reset(c->json);
+    }
+}
+
+/**
+ * post_fields: NULL for GET
+ */
+bool http_prepare(bilibili_service *s, http_conn *c, endpoint ep, const char *post_fields)
+{
+    c->ep = ep;
+    dstr_copy(&c->url, endpoints[ep].url);
+    c->json = NULL;
+    http_reset_response(c);
+    curl_slist_free_all(c->headers);
+    c->headers = NULL;
+    CURL *curl = client_handle(s, c);
+    if (!curl)
+    {
+        return false;
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, c->url.array);
+    if (post_fields)
+    {
+        curl_easy_setopt(curl, CURLOPT_COPYPOSTFIELDS, post_fields);
+    }
+    return true;
+}
+
+void launch_hedge(bilibili_service *s, CURLM *multi, http_conn *c, double after)
+{
+    if (!c->hedge)
+    {
+        c->hedge = bzalloc(sizeof(http_conn));
+    }
+    http_conn *h = c->hedge;
+    h->primary = c;
+    dstr_copy_dstr(&h->url, &c->url);
+    h->ep = c->ep;
+    h->jar = c->jar;
+    bfree(h->etag);
+    bfree(h->last_modified);
+    h->etag = NULL;
+    h->last_modified = NULL;
+    if (!client_handle(s, h))
+    {
+        return;
+    }
+    curl_easy_setopt(h->curl, CURLOPT_URL, c->url.array);
+    if (c->headers)
+    {
+        curl_easy_setopt(h->curl, CURLOPT_HTTPHEADER, c->headers);
+    }
+    h->running = true;
+    c->hedge_active = true;
+    curl_multi_add_handle(multi, h->curl);
+    blog(LOG_INFO, "%s slower than p95 %.0f ms, hedging", endpoints[c->ep].name, after);
+}
+
+/**
+ * x: the handle that finished, c itself or its hedge
+ * return: whether c is settled
+ */
+bool http_finish(CURLM *multi, http_conn *c, http_conn *x, CURLcode result, uint64_t begin)
+{
+    http_conn *other = x == c ? (c->hedge_active ? c->hedge : NULL) : c;
+    x->running = false;
+    metrics_record(c->ep, x->curl, result, c->winner == x ? c->decoded : 0);
+    // wait for the other one if this attempt failed or lost the race
+    if ((result != CURLE_OK || (c->winner && c->winner != x)) && other && other->running)
+    {
+        return false;
+    }
+
+    double total = 0;
+    c->result = result;
+    curl_easy_getinfo(x->curl, CURLINFO_RESPONSE_CODE, &c->status);
+    curl_easy_getinfo(x->curl, CURLINFO_TOTAL_TIME, &total);
+    if (x != c)
+    {
+        bfree(c->etag);
+        bfree(c->last_modified);
+        c->etag = x->etag;
+        c->last_modified = x->last_modified;
+        x->etag = NULL;
+        x->last_modified = NULL;
+    }
+    if (other && other->running)
+    {
+        curl_multi_remove_handle(multi, other->curl);
+        other->running = false;
+    }
+    c->done = true;
+
+    blog(LOG_DEBUG, "%s: done at +%.1f ms, took %.1f ms%s", c->url.array,
+        (os_gettime_ns() - begin) / 1000000.0, total * 1000.0, x != c ? " (hedge)" : "");
+    if (result == CURLE_OK)
+    {
+        latency_record(c->ep, total * 1000.0);
+    }
+    else
+    {
+        blog(LOG_WARNING, "request %s failed: %s", c->url.array, curl_easy_strerror(result));
+    }
+    return true;
+}
+
+/**
+ * drive all prepared connections at once on the service's multi handle,
+ * the multi handle owns the connection cache from here on
+ */
+void http_run(bilibili_service *s, http_conn **conns, int count)
+{
+    if (!count)
+    {
+        return;
+    }
+    if (!s->multi)
+    {
+        s->multi = curl_multi_init();
+        if (!s->multi)
+        {
+            return;
+        }
+    }
+    CURLM *multi = s->multi;
+    uint64_t begin = os_gettime_ns();
+    for (int i = 0; i < count; i++)
+    {
+        http_conn *c = conns[i];
+        c->done = false;
+        c->hedge_active = false;
+        c->running = true;
+        c->hedge_after = endpoints[c->ep].read_only ? latency_p95(c->ep) : -1;
+        curl_multi_add_handle(multi, c->curl);
+    }
+
+    int running = count;
+    int pending = count;
+    // destroy joins the worker, give up on whatever is still in flight
+    while (pending && !os_atomic_load_bool(&s->exiting))
+    {
+        if (curl_multi_perform(multi, &running) != CURLM_OK)
+        {
+            break;
+        }
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(multi, &left)))
+        {
+            for (int i = 0; msg->msg == CURLMSG_DONE && i < count; i++)
+            {
+                http_conn *c = conns[i];
+                http_conn *x = c->curl == msg->easy_handle ? c :
+                    (c->hedge_active && c->hedge->curl == msg->easy_handle ? c->hedge : NULL);
+                if (x && !c->done && http_finish(multi, c, x, msg->data.result, begin))
+                {
+                    pending--;
+                }
+            }
+        }
+        if (!running)
+        {
+            break;
+        }
+
+        double elapsed = (os_gettime_ns() - begin) / 1000000.0;
+        for (int i = 0; i < count; i++)
+        {
+            http_conn *c = conns[i];
+            // only hedge a call that has not started answering
+            if (!c->done && !c->hedge_active && !c->winner && c->hedge_after > 0 && elapsed > c->hedge_after)
+            {
+                launch_hedge(s, multi, c, c->hedge_after);
+            }
+        }
+        curl_multi_wait(multi, NULL, 0, 50, NULL);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        http_conn *c = conns[i];
+        curl_multi_remove_handle(multi, c->curl);
+        c->running = false;
+        if (!c->done)
+        {
+            c->result = CURLE_ABORTED_BY_CALLBACK;
+        }
+        if (c->hedge_active)
+        {
+            curl_multi_remove_handle(multi, c->hedge->curl);
+            c->hedge->running = false;
+            c->hedge_active = false;
+        }
+    }
+}
+
+bool should_retry(http_conn *c)
+{
+    if (!endpoints[c->ep].read_only)
+    {
+        return false;
+    }
+    // a malformed body will not get better
+    if (c->result == CURLE_WRITE_ERROR)
+    {
+        return false;
+    }
+    return c->result != CURLE_OK || c->status >= 500 || c->status == 429;
+}
+
+/**
+ * sleep in short slices
+ * return: false if the service is being destroyed
+ */
+bool sleep_unless_exiting(bilibili_service *s, uint32_t ms)
+{
+    for (uint32_t slept = 0; slept < ms; slept += 50)
+    {
+        if (os_atomic_load_bool(&s->exiting))
+        {
+            return false;
+        }
+        os_sleep_ms(ms - slept < 50 ? ms - slept : 50);
+    }
+    return !os_atomic_load_bool(&s->exiting);
+}
+
+/**
+ * http_run, then retry failed read-only calls with jittered backoff
+ */
+void http_run_retry(bilibili_service *s, http_conn **conns, int count)
+{
+    uint64_t begin = os_gettime_ns();
+    http_conn **retry = bmalloc(count * sizeof(http_conn *));
+    http_run(s, conns, count);
+    for (int attempt = 0; attempt < API_RETRIES; attempt++)
+    {
+        int n = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (should_retry(conns[i]))
+            {
+                retry[n++] = conns[i];
+            }
+        }
+        uint32_t delay = backoff_ms(attempt);
+        if (!n || (os_gettime_ns() - begin) / 1000000 + delay > API_RETRY_BUDGET_MS)
+        {
+            break;
+        }
+        if (!sleep_unless_exiting(s, delay))
+        {
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            blog(LOG_INFO, "retrying %s, attempt %d", endpoints[retry[i]->ep].name, attempt + 2);
+            http_reset_response(retry[i]);
+        }
+        http_run(s, retry, n);
+    }
+    bfree(retry);
+}
+
+bool http_request(bilibili_service *s, http_conn *c, endpoint ep, const char *post_fields)
+{
+    if (!http_prepare(s, c, ep, post_fields))
+    {
+        return false;
+    }
+    http_run_retry(s, &c, 1);
+    return c->result == CURLE_OK;
+}
+
+uint32_t hash_bytes(const char *data, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (uint8_t)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+uint32_t hash_name(const char *name)
+{
+    return hash_bytes(name, strlen(name));
+}
+
+area_entry *area_slot(area_entry *slots, size_t capacity, const char *name)
+{
+    size_t mask = capacity - 1;
+    size_t i = hash_name(name) & mask;
+    while (slots[i].name && strcmp(slots[i].name, name) != 0)
+    {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+void area_index_clear(void)
+{
+    arena_free(&areas.names);
+    bfree(areas.slots);
+    bfree(areas.sorted);
+    areas.slots = NULL;
+    areas.sorted = NULL;
+    areas.capacity = 0;
+    areas.count = 0;
+}
+
+int compare_name(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * rebuild the sorted view after a batch of inserts, caller holds the mutex
+ */
+void area_index_sort(void)
+{
+    bfree(areas.sorted);
+    areas.sorted = bmalloc((areas.count ? areas.count : 1) * sizeof(char *));
+    size_t n = 0;
+    for (size_t i = 0; i < areas.capacity; i++)
+    {
+        if (areas.slots[i].name)
+        {
+            areas.sorted[n++] = areas.slots[i].name;
+        }
+    }
+    qsort(areas.sorted, n, sizeof(char *), compare_name);
+}
+
+/**
+ * offer every cached area in the picker, never touches the network
+ */
+void area_index_fill_list(obs_property_t *p)
+{
+    pthread_mutex_lock(&areas.mutex);
+    for (size_t i = 0; areas.sorted && i < areas.count; i++)
+    {
+        obs_property_list_add_string(p, areas.sorted[i], areas.sorted[i]);
+    }
+    pthread_mutex_unlock(&areas.mutex);
+}
+
+void area_index_insert(const char *name, int32_t id)
+{
+    if (!name || !*name)
+    {
+        return;
+    }
+    if ((areas.count + 1) * 2 > areas.capacity)
+    {
+        size_t capacity = areas.capacity ? areas.capacity * 2 : 256;
+        area_entry *slots = bzalloc(capacity * sizeof(area_entry));
+        for (size_t i = 0; i < areas.capacity; i++)
+        {
+            if (areas.slots[i].name)
+            {
+                *area_slot(slots, capacity, areas.slots[i].name) = areas.slots[i];
+            }
+        }
+        bfree(areas.slots);
+        areas.slots = slots;
+        areas.capacity = capacity;
+    }
+    area_entry *e = area_slot(areas.slots, areas.capacity, name);
+    if (!e->name)
+    {
+        e->name = arena_strdup(&areas.names, name);
+        areas.count++;
+    }
+    e->id = id;
+}
+
+int32_t area_index_find(const char *name)
+{
+    int32_t id = -1;
+    if (!name)
+    {
+        return id;
+    }
+    pthread_mutex_lock(&areas.mutex);
+    if (areas.capacity)
+    {
+        area_entry *e = area_slot(areas.slots, areas.capacity, name);
+        if (e->name)
+        {
+            id = e->id;
+        }
+    }
+    pthread_mutex_unlock(&areas.mutex);
+    return id;
+}
+
+bool area_cache_stale(void)
+{
+    pthread_mutex_lock(&areas.mutex);
+    bool stale = time(NULL) - areas.fetched_at > AREA_CACHE_TTL;
+    pthread_mutex_unlock(&areas.mutex);
+    return stale;
+}
+
+void area_cache_save(void)
+{
+    char *dir = obs_module_config_path("");
+    char *path = obs_module_config_path(AREA_CACHE_FILE);
+    obs_data_t *cache = obs_data_create();
+    obs_data_array_t *list = obs_data_array_create();
+
+    for (size_t i = 0; i < areas.capacity; i++)
+    {
+        area_entry *e = &areas.slots[i];
+        if (e->name)
+        {
+            obs_data_t *item = obs_data_create();
+            obs_data_set_string(item, "name", e->name);
+            obs_data_set_int(item, "id", e->id);
+            obs_data_array_push_back(list, item);
+            obs_data_release(item);
+        }
+    }
+    obs_data_set_array(cache, "areas", list);
+    obs_data_set_int(cache, "fetched_at", areas.fetched_at);
+    obs_data_set_string(cache, "etag", areas.etag ? areas.etag : "");
+    obs_data_set_string(cache, "last_modified", areas.last_modified ? areas.last_modified : "");
+
+    os_mkdirs(dir);
+    if (!obs_data_save_json_safe(cache, path, "tmp", "bak"))
+    {
+        blog(LOG_WARNING, "failed to save %s", path);
+    }
+    obs_data_array_release(list);
+    obs_data_release(cache);
+    bfree(path);
+    bfree(dir);
+}
+
+void area_cache_load(void)
+{
+    char *path = obs_module_config_path(AREA_CACHE_FILE);
+    obs_data_t *cache = obs_data_create_from_json_file_safe(path, "bak");
+    bfree(path);
+    if (!cache)
+    {
+        return;
+    }
+    obs_data_array_t *list = obs_data_get_array(cache, "areas");
+    size_t size = obs_data_array_count(list);
+
+    pthread_mutex_lock(&areas.mutex);
+    for (size_t i = 0; i < size; i++)
+    {
+        obs_data_t *item = obs_data_array_item(list, i);
+        area_index_insert(obs_data_get_string(item, "name"), (int32_t)obs_data_get_int(item, "id"));
+        obs_data_release(item);
+    }
+    area_index_sort();
+    areas.fetched_at = obs_data_get_int(cache, "fetched_at");
+    my_strdup(&areas.etag, obs_data_get_string(cache, "etag"));
+    my_strdup(&areas.last_modified, obs_data_get_string(cache, "last_modified"));
+    pthread_mutex_unlock(&areas.mutex);
+
+    obs_data_array_release(list);
+    obs_data_release(cache);
+}
+
+void area_index_init(void)
+{
+    pthread_mutex_init(&areas.mutex, NULL);
+    area_cache_load();
+}
+
+void area_index_free(void)
+{
+    area_index_clear();
+    bfree(areas.etag);
+    bfree(areas.last_modified);
+    pthread_mutex_destroy(&areas.mutex);
+}
+
+const char *area_paths[] = {
+    "data[].list[].name",
+    "data[].list[].id",
+    "data[].list[]"
+};
+
+void area_parse_value(void *param, size_t index, const char *value)
+{
+    area_parse *p = param;
+    if (index == 2)
+    {
+        if (p->name)
+        {
+            area_entry e = {p->name, p->id};
+            da_push_back(p->entries, &e);
+            p->name = NULL;
+        }
+        p->id = -1;
+    }
+    else if (value && index == 0)
+    {
+        p->name = arena_strdup(&p->names, value);
+    }
+    else if (value && index == 1)
+    {
+        p->id = atoi(value);
+    }
+}
+
+void area_parse_free(area_parse *p)
+{
+    da_free(p->entries);
+    arena_free(&p->names);
+    p->name = NULL;
+}
+
+/**
+ * revalidate with the validators of the cached copy
+ */
+bool prepare_area_request(bilibili_service *s, http_conn *c)
+{
+    if (!http_prepare(s, c, endpoint_get_list, NULL))
+    {
+        return false;
+    }
+    struct dstr header = {0};
+    pthread_mutex_lock(&areas.mutex);
+    if (areas.count && areas.etag && *areas.etag)
+    {
+        dstr_printf(&header, "If-None-Match: %s", areas.etag);
+        c->headers = curl_slist_append(c->headers, header.array);
+    }
+    if (areas.count && areas.last_modified && *areas.last_modified)
+    {
+        dstr_printf(&header, "If-Modified-Since: %s", areas.last_modified);
+        c->headers = curl_slist_append(c->headers, header.array);
+    }
+    pthread_mutex_unlock(&areas.mutex);
+    dstr_free(&header);
+    curl_easy_setopt(c->curl, CURLOPT_HTTPHEADER, c->headers);
+    return true;
+}
+
+void update_area_index(http_conn *c, area_parse *p)
+{
+    pthread_mutex_lock(&areas.mutex);
+    if (c->status == 304)
+    {
+        areas.fetched_at = time(NULL);
+        area_cache_save();
+    }
+    // error responses carry no areas, keep what we have
+    else if (c->status == 200 && json_stream_finish(c->json) && p->entries.num)
+    {
+        area_index_clear();
+        for (size_t i = 0; i < p->entries.num; i++)
+        {
+            area_index_insert(p->entries.array[i].name, p->entries.array[i].id);
+        }
+        area_index_sort();
+        areas.fetched_at = time(NULL);
+        my_strdup(&areas.etag, c->etag ? c->etag : "");
+        my_strdup(&areas.last_modified, c->last_modified ? c->last_modified : "");
+        area_cache_save();
+        blog(LOG_INFO, "area list updated, %u areas", (unsigned)areas.count);
+    }
+    pthread_mutex_unlock(&areas.mutex);
+}
+
+/**
+ * area list and room id do not depend on each other, fetch them together
+ */
+bool sim_room_prepare(bilibili_service *s, sim_room *r, endpoint ep, const char *post_fields,
+    const char **paths, size_t count)
+{
+    r->conn.jar = &r->jar;
+    if (!http_prepare(s, &r->conn, ep, post_fields))
+    {
+        return false;
+    }
+    json_stream_init(&r->json, paths, count, json_capture_fields, r->fields);
+    r->conn.json = &r->json;
+    return true;
+}
+
+void sim_room_end(sim_room *r)
+{
+    if (!r->conn.json)
+    {
+        return;
+    }
+    r->conn.json = NULL;
+    json_free_fields(r->fields, 3);
+    json_stream_free(&r->json);
+}
+
+/**
+ * use: count owner as a user, a simulcast room has none until adopted
+ */
+void publish_room(bilibili_service *owner, long long room_id, const char *addr, const char *code, bool use)
+{
+    pthread_mutex_lock(&rooms_mutex);
+    live_room *room = NULL;
+    for (size_t i = 0; i < live_rooms.num && !room; i++)
+    {
+        if (live_rooms.array[i].room_id == room_id)
+        {
+            room = &live_rooms.array[i];
+        }
+    }
+    if (!room)
+    {
+        room = da_push_back_new(live_rooms);
+        room->room_id = room_id;
+    }
+    room->owner = owner;
+    room->users += use;
+    my_strdup(&room->addr, addr);
+    my_strdup(&room->code, code);
+    pthread_mutex_unlock(&rooms_mutex);
+}
+
+/**
+ * return: services still streaming to the room
+ */
+int room_users(long long room_id)
+{
+    int users = 0;
+    pthread_mutex_lock(&rooms_mutex);
+    for (size_t i = 0; i < live_rooms.num; i++)
+    {
+        if (live_rooms.array[i].room_id == room_id)
+        {
+            users = live_rooms.array[i].users;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rooms_mutex);
+    return users;
+}
+
+/**
+ * drop this service's use of its room, once: stop retries call it again
+ * return: services still streaming to the room
+ */
+int release_room(bilibili_service *s)
+{
+    pthread_mutex_lock(&rooms_mutex);
+    for (size_t i = 0; i < live_rooms.num && s->holds_room; i++)
+    {
+        live_room *room = &live_rooms.array[i];
+        if (room->room_id == s->room_id && room->users > 0)
+        {
+            room->users--;
+            break;
+        }
+    }
+    s->holds_room = false;
+    pthread_mutex_unlock(&rooms_mutex);
+    return room_users(s->room_id);
+}
+
+void unpublish_room(long long room_id)
+{
+    pthread_mutex_lock(&rooms_mutex);
+    for (size_t i = 0; i < live_rooms.num; i++)
+    {
+        if (live_rooms.array[i].room_id == room_id)
+        {
+            bfree(live_rooms.array[i].addr);
+            bfree(live_rooms.array[i].code);
+            da_erase(live_rooms, i);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&rooms_mutex);
+}
+
+/**
+ * drop what a destroyed service left behind, its address may be reused
+ */
+void unpublish_owner(bilibili_service *owner)
+{
+    pthread_mutex_lock(&rooms_mutex);
+    for (size_t i = live_rooms.num; i > 0; i--)
+    {
+        if (live_rooms.array[i - 1].owner == owner)
+        {
+            bfree(live_rooms.array[i - 1].addr);
+            bfree(live_rooms.array[i - 1].code);
+            da_erase(live_rooms, i - 1);
+        }
+    }
+    pthread_mutex_unlock(&rooms_mutex);
+}
+
+/**
+ * return: whether this process put the room live
+ */
+bool room_published(long long room_id)
+{
+    bool found = false;
+    pthread_mutex_lock(&rooms_mutex);
+    for (size_t i = 0; i < live_rooms.num && !found; i++)
+    {
+        found = live_rooms.array[i].room_id == room_id;
+    }
+    pthread_mutex_unlock(&rooms_mutex);
+    return found;
+}
+
+/**
+ * another service already put the room live, e.g. as a simulcast target
+ */
+bool adopt_room(bilibili_service *s)
+{
+    bool found = false;
+    pthread_mutex_lock(&rooms_mutex);
+    for (size_t i = 0; i < live_rooms.num && !found; i++)
+    {
+        live_room *room = &live_rooms.array[i];
+        // an entry of our own is stale, its stop did not go through
+        found = room->room_id == s->room_id && room->owner != s;
+        if (found)
+        {
+            room->users += !s->holds_room;
+            s->holds_room = true;
+            pthread_mutex_lock(&s->task_mutex);
+            my_strdup(&s->addr, room->addr);
+            my_strdup(&s->code, room->code);
+            s->creds_cached = true;
+            pthread_mutex_unlock(&s->task_mutex);
+        }
+    }
+    pthread_mutex_unlock(&rooms_mutex);
+    if (found)
+    {
+        blog(LOG_INFO, "room %lld is already live, reusing its ingest", s->room_id);
+    }
+    return found;
+}
+
+bool prepare_ids(bilibili_service *s)
+{
+    profile_start(profile_prepare);
+    bool need_area = area_cache_stale() || area_index_find(s->area) == -1;
+    bool need_room = !s->room_id;
+    http_conn *area = &s->conn[conn_main];
+    http_conn *room = &s->conn[conn_aux];
+    http_conn **list = bmalloc((conn_count + s->sims.num) * sizeof(http_conn *));
+    int count = 0;
+
+    area_parse areas_found = {.id = -1};
+    json_stream area_json;
+    json_stream_init(&area_json, area_paths, 3, area_parse_value, &areas_found);
+    const char *room_paths[] = {"code", "data.roomid"};
+    char *room_fields[2] = {NULL};
+    json_stream room_json;
+    json_stream_init(&room_json, room_paths, 2, json_capture_fields, room_fields);
+
+    if (need_area && prepare_area_request(s, area))
+    {
+        area->json = &area_json;
+        list[count++] = area;
+    }
+    if (need_room && http_prepare(s, room, endpoint_liveinfo, NULL))
+    {
+        room->json = &room_json;
+        list[count++] = room;
+    }
+    for (size_t i = 0; i < s->sims.num; i++)
+    {
+        sim_room *r = &s->sims.array[i];
+        if (!r->room_id && sim_room_prepare(s, r, endpoint_liveinfo, NULL, room_paths, 2))
+        {
+            list[count++] = &r->conn;
+        }
+    }
+    http_run_retry(s, list, count);
+    bfree(list);
+
+    for (size_t i = 0; i < s->sims.num; i++)
+    {
+        sim_room *r = &s->sims.array[i];
+        if (r->conn.json && r->conn.result == CURLE_OK && json_stream_finish(&r->json) &&
+            r->fields[0] && atoi(r->fields[0]) == 0 && r->fields[1])
+        {
+            r->room_id = strtoll(r->fields[1], NULL, 10);
+        }
+        sim_room_end(r);
+    }
+
+    // a failed refresh keeps serving the cached index
+    if (need_area && area->result == CURLE_OK)
+    {
+        update_area_index(area, &areas_found);
+    }
+    s->area_id = area_index_find(s->area);
+    if (s->area_id == -1)
+    {
+        // no guessing, a near miss would start the stream in the wrong area
+        blog(LOG_ERROR, "area %s not found, pick an exact name from the list", s->area);
+    }
+    if (need_room && room->result == CURLE_OK && json_stream_finish(&room_json) &&
+        room_fields[0] && atoi(room_fields[0]) == 0 && room_fields[1])
+    {
+        s->room_id = strtoll(room_fields[1], NULL, 10);
+    }
+
+    area->json = NULL;
+    room->json = NULL;
+    area_parse_free(&areas_found);
+    json_stream_free(&area_json);
+    json_free_fields(room_fields, 2);
+    json_stream_free(&room_json);
+    profile_end(profile_prepare);
+    return s->area_id != -1 && s->room_id;
+}
+
+/**
+ * return: false when the api could not be reached, a rejected call is
+ * only logged
+ */
+bool stop_done(http_conn *c, json_stream *json, char **fields)
+{
+    if (c->result != CURLE_OK || c->status >= 500 || !json_stream_finish(json))
+    {
+        return false;
+    }
+    if (!fields[0] || strcmp(fields[0], "0") != 0)
+    {
+        blog(LOG_ERROR, "stopLive rejected: %s", fields[1] ? fields[1] : "(no message)");
+    }
+    return true;
+}
+
+/**
+ * stops this room and the simulcast rooms still live in one batch
+ * return: false when some room should be retried
+ */
+bool stop_live(bilibili_service *s)
+{
+    if (!s->room_id)
+    {
+        prepare_ids(s);
+    }
+    http_conn *c = &s->conn[conn_main];
+    http_conn **list = bmalloc((1 + s->sims.num) * sizeof(http_conn *));
+    int count = 0;
+    char post_fields[1024];
+    const char *paths[] = {"code", "msg"};
+    char *fields[2] = {NULL};
+    json_stream json;
+    json_stream_init(&json, paths, 2, json_capture_fields, fields);
+
+    // another output adopted the room and still streams to it
+    bool stop_main = s->room_id && release_room(s) == 0;
+    if (s->room_id && !stop_main)
+    {
+        blog(LOG_INFO, "room %lld is still in use, leaving it live", s->room_id);
+    }
+
+    profile_start(profile_stop_live);
+    if (stop_main)
+    {
+        snprintf(post_fields, sizeof(post_fields), "room_id=%lld&platform=pc&csrf_token=%s", s->room_id, csrf_token(&s->jar));
+        if (http_prepare(s, c, endpoint_stop_live, post_fields))
+        {
+            c->json = &json;
+            list[count++] = c;
+        }
+    }
+    for (size_t i = 0; i < s->sims.num; i++)
+    {
+        sim_room *r = &s->sims.array[i];
+        if (!r->live)
+        {
+            continue;
+        }
+        // handed over, the adopting service stops it after its output
+        if (room_users(r->room_id) > 0)
+        {
+            blog(LOG_INFO, "simulcast room %lld is still in use, leaving it live", r->room_id);
+            r->live = false;
+            continue;
+        }
+        snprintf(post_fields, sizeof(post_fields), "room_id=%lld&platform=pc&csrf_token=%s", r->room_id, csrf_token(&r->jar));
+        if (sim_room_prepare(s, r, endpoint_stop_live, post_fields, paths, 2))
+        {
+            list[count++] = &r->conn;
+        }
+    }
+    http_run(s, list, count);
+    profile_end(profile_stop_live);
+    bfree(list);
+
+    bool done = s->room_id && (!stop_main || (c->json && stop_done(c, &json, fields)));
+    if (done && stop_main)
+    {
+        unpublish_room(s->room_id);
+    }
+    c->json = NULL;
+    for (size_t i = 0; i < s->sims.num; i++)
+    {
+        sim_room *r = &s->sims.array[i];
+        if (!r->conn.json)
+        {
+            continue;
+        }
+        if (stop_done(&r->conn, &r->json, r->fields))
+        {
+            r->live = false;
+            unpublish_room(r->room_id);
+            save_stop_pending(r->room_id, false);
+        }
+        else
+        {
+            done = false;
+        }
+        sim_room_end(r);
+    }
+    json_free_fields(fields, 2);
+    json_stream_free(&json);
+    return done;
+}
+
+/**
+ * simulcast rooms go out in the same batch, so start time does not grow
+ * with the number of rooms
+ */
+bool start_live(bilibili_service *s)
+{
+    if (!prepare_ids(s)) return false;
+    http_conn *c = &s->conn[conn_main];
+    http_conn **list = bmalloc((1 + s->sims.num) * sizeof(http_conn *));
+    int count = 0;
+    char post_fields[1024];
+    const char *paths[] = {"data.rtmp.addr", "data.rtmp.code", "msg"};
+    char *fields[3] = {NULL};
+    json_stream json;
+    json_stream_init(&json, paths, 3, json_capture_fields, fields);
+
+    profile_start(profile_start_live);
+    snprintf(post_fields, sizeof(post_fields), "room_id=%lld&platform=pc&area_v2=%d&csrf_token=%s", s->room_id, s->area_id, csrf_token(&s->jar));
+    bool result = http_prepare(s, c, endpoint_start_live, post_fields);
+    if (result)
+    {
+        c->json = &json;
+        list[count++] = c;
+    }
+    for (size_t i = 0; i < s->sims.num; i++)
+    {
+        sim_room *r = &s->sims.array[i];
+        // still streamed to by an adopter, a new startLive would rotate its key
+        if (!r->room_id || room_users(r->room_id) > 0)
+        {
+            continue;
+        }
+        snprintf(post_fields, sizeof(post_fields), "room_id=%lld&platform=pc&area_v2=%d&csrf_token=%s", r->room_id, s->area_id, csrf_token(&r->jar));
+        if (sim_room_prepare(s, r, endpoint_start_live, post_fields, paths, 3))
+        {
+            list[count++] = &r->conn;
+        }
+    }
+    http_run(s, list, count);
+    profile_end(profile_start_live);
+    bfree(list);
+
+    c->json = NULL;
+    result = result && c->result == CURLE_OK && json_stream_finish(&json) && fields[0] && fields[1];
+    if (result)
+    {
+        pthread_mutex_lock(&s->task_mutex);
+        my_strdup(&(s->addr), fields[0]);
+        my_strdup(&(s->code), fields[1]);
+        pthread_mutex_unlock(&s->task_mutex);
+        publish_room(s, s->room_id, fields[0], fields[1], !s->holds_room);
+        s->holds_room = true;
+        blog(LOG_DEBUG, "startLive %s %s", s->addr, s->code);
+    }
+    else
+    {
+        blog(LOG_ERROR, "failed to post startLive: %s", fields[2] ? fields[2] : "");
+    }
+    for (size_t i = 0; i < s->sims.num; i++)
+    {
+        sim_room *r = &s->sims.array[i];
+        if (!r->conn.json)
+        {
+            continue;
+        }
+        if (r->conn.result == CURLE_OK && json_stream_finish(&r->json) && r->fields[0] && r->fields[1])
+        {
+            r->live = true;
+            publish_room(s, r->room_id, r->fields[0], r->fields[1], false);
+            emit_room_live(s, r);
+            blog(LOG_INFO, "simulcast room %lld is live", r->room_id);
+        }
+        else
+        {
+            blog(LOG_ERROR, "failed to start simulcast room %lld: %s", r->room_id, r->fields[2] ? r->fields[2] : "");
+        }
+        sim_room_end(r);
+    }
+    json_free_fields(fields, 3);
+    json_stream_free(&json);
+    return result;
+}
+
+void save_credentials(long long room_id, const char *addr, const char *code)
+{
+    char *dir = obs_module_config_path("");
+    char *path = obs_module_config_path(CREDENTIALS_FILE);
+    char key[32];
+    sprintf(key, "%lld", room_id);
+
+    pthread_mutex_lock(&credentials_mutex);
+    obs_data_t *all = obs_data_create_from_json_file_safe(path, "bak");
+    if (!all)
+    {
+        all = obs_data_create();
+    }
+    obs_data_t *room = obs_data_create();
+    obs_data_set_string(room, "addr", addr);
+    obs_data_set_string(room, "code", code);
+    obs_data_set_obj(all, key, room);
+    os_mkdirs(dir);
+    if (!obs_data_save_json_safe(all, path, "tmp", "bak"))
+    {
+        blog(LOG_WARNING, "failed to save %s", path);
+    }
+    pthread_mutex_unlock(&credentials_mutex);
+
+    obs_data_release(room);
+    obs_data_release(all);
+    bfree(path);
+    bfree(dir);
+}
+
+/**
+ * pick up the last known-good ingest of the room so that the next stream
+ * start does not have to wait for startLive
+ */
+void load_credentials(bilibili_service *s)
+{
+    char *path = obs_module_config_path(CREDENTIALS_FILE);
+    char key[32];
+    sprintf(key, "%lld", s->room_id);
+
+    pthread_mutex_lock(&credentials_mutex);
+    obs_data_t *all = obs_data_create_from_json_file_safe(path, "bak");
+    pthread_mutex_unlock(&credentials_mutex);
+    bfree(path);
+
+    obs_data_t *room = obs_data_get_obj(all, key);
+    const char *addr = obs_data_get_string(room, "addr");
+    const char *code = obs_data_get_string(room, "code");
+    // a room this process put live is not a leftover
+    if (obs_data_get_bool(room, "stop_pending") && !room_published(s->room_id))
+    {
+        blog(LOG_INFO, "room %lld may still be live, stopping it", s->room_id);
+        pthread_mutex_lock(&s->task_mutex);
+        s->stop_pending = true;
+        pthread_mutex_unlock(&s->task_mutex);
+    }
+    if (room && *addr && *code)
+    {
+        pthread_mutex_lock(&s->task_mutex);
+        if (!s->addr)
+        {
+            my_strdup(&s->addr, addr);
+            my_strdup(&s->code, code);
+            s->creds_cached = true;
+        }
+        pthread_mutex_unlock(&s->task_mutex);
+    }
+    obs_data_release(room);
+    obs_data_release(all);
+}
+
+/**
+ * a stop that did not go through is remembered so that the room is not
+ * left live if obs exits before the api is reachable again
+ */
+void save_stop_pending(long long room_id, bool pending)
+{
+    char *dir = obs_module_config_path("");
+    char *path = obs_module_config_path(CREDENTIALS_FILE);
+    char key[32];
+    sprintf(key, "%lld", room_id);
+
+    pthread_mutex_lock(&credentials_mutex);
+    obs_data_t *all = obs_data_create_from_json_file_safe(path, "bak");
+    if (!all)
+    {
+        all = obs_data_create();
+    }
+    obs_data_t *room = obs_data_get_obj(all, key);
+    if (!room)
+    {
+        room = obs_data_create();
+        obs_data_set_obj(all, key, room);
+    }
+    obs_data_set_bool(room, "stop_pending", pending);
+    os_mkdirs(dir);
+    if (!obs_data_save_json_safe(all, path, "tmp", "bak"))
+    {
+        blog(LOG_WARNING, "failed to save %s", path);
+    }
+    pthread_mutex_unlock(&credentials_mutex);
+
+    obs_data_release(room);
+    obs_data_release(all);
+    bfree(path);
+    bfree(dir);
+}
+
+bool load_stop_pending(long long room_id)
+{
+    char *path = obs_module_config_path(CREDENTIALS_FILE);
+    char key[32];
+    sprintf(key, "%lld", room_id);
+
+    pthread_mutex_lock(&credentials_mutex);
+    obs_data_t *all = obs_data_create_from_json_file_safe(path, "bak");
+    pthread_mutex_unlock(&credentials_mutex);
+    bfree(path);
+
+    obs_data_t *room = obs_data_get_obj(all, key);
+    bool pending = obs_data_get_bool(room, "stop_pending");
+    obs_data_release(room);
+    obs_data_release(all);
+    return pending;
+}
+
+/**
+ * mark the room and every live simulcast room, a crash before stopLive
+ * then still gets them stopped on the next load
+ */
+void save_live_rooms(bilibili_service *s)
+{
+    if (s->room_id)
+    {
+        save_stop_pending(s->room_id, true);
+    }
+    for (size_t i = 0; i < s->sims.num; i++)
+    {
+        if (s->sims.array[i].live)
+        {
+            save_stop_pending(s->sims.array[i].room_id, true);
+        }
+    }
+}
+
+/**
+ * simulcast rooms left live by a previous run join the pending stop
+ */
+void recover_sim_rooms(bilibili_service *s)
+{
+    bool found = false;
+    for (size_t i = 0; i < s->sims.num; i++)
+    {
+        sim_room *r = &s->sims.array[i];
+        if (r->room_id && !r->live && !room_published(r->room_id) && load_stop_pending(r->room_id))
+        {
+            blog(LOG_INFO, "simulcast room %lld may still be live, stopping it", r->room_id);
+            r->live = true;
+            found = true;
+        }
+    }
+    if (found)
+    {
+        pthread_mutex_lock(&s->task_mutex);
+        s->stop_pending = true;
+        pthread_mutex_unlock(&s->task_mutex);
+    }
+}
+
+/**
+ * restart the output so it picks up credentials that changed under it
+ */
+void reconnect_stream(bilibili_service *s)
+{
+    if (!obs_frontend_streaming_active())
+    {
+        return;
+    }
+    blog(LOG_INFO, "stream key rotated, reconnecting");
+    pthread_mutex_lock(&s->task_mutex);
+    s->reconnecting = true;
+    pthread_mutex_unlock(&s->task_mutex);
+    obs_frontend_streaming_stop();
+}
+
+/**
+ * url: rtmp://host[:port]/app/
+ * return: http://host:port for a tcp connect probe
+ */
+bool ingest_probe_url(const char *url, struct dstr *out)
+{
+    const char *host = strstr(url, "://");
+    if (!host)
+    {
+        return false;
+    }
+    host += 3;
+    const char *end = strchr(host, '/');
+    size_t len = end ? (size_t)(end - host) : strlen(host);
+    if (!len)
+    {
+        return false;
+    }
+    dstr_copy(out, "http://");
+    dstr_ncat(out, host, len);
+    if (!memchr(host, ':', len))
+    {
+        dstr_cat(out, ":1935");
+    }
+    return true;
+}
+
+void score_ingest(ingest *in, CURL *curl, CURLcode result)
+{
+    double sample = INGEST_FAIL_RTT;
+    if (result == CURLE_OK)
+    {
+        double connect = 0, lookup = 0;
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+        curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &lookup);
+        sample = (connect - lookup) * 1000.0;
+        in->failures = 0;
+    }
+    else
+    {
+        in->failures++;
+    }
+    in->rtt = in->rtt < 0 ? sample : in->rtt + (sample - in->rtt) * INGEST_SMOOTHING;
+    blog(LOG_DEBUG, "ingest %s: %.1f ms (smoothed %.1f ms)", in->url, sample, in->rtt);
+}
+
+/**
+ * tcp connect to every candidate at once, bounded by INGEST_PROBE_TIMEOUT_MS
+ */
+void probe_ingests(bilibili_service *s)
+{
+    CURL *handles[INGEST_MAX] = {NULL};
+    size_t count = s->ingests.num;
+    struct dstr url = {0};
+    CURLM *multi = curl_multi_init();
+    if (!multi || !count)
+    {
+        if (multi) curl_multi_cleanup(multi);
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!ingest_probe_url(s->ingests.array[i].url, &url) || !(handles[i] = curl_easy_init()))
+        {
+            continue;
+        }
+        if (curl_share)
+        {
+            curl_easy_setopt(handles[i], CURLOPT_SHARE, curl_share);
+        }
+        curl_easy_setopt(handles[i], CURLOPT_URL, url.array);
+        curl_easy_setopt(handles[i], CURLOPT_CONNECT_ONLY, 1L);
+        curl_easy_setopt(handles[i], CURLOPT_CONNECTTIMEOUT_MS, (long)INGEST_PROBE_TIMEOUT_MS);
+        curl_multi_add_handle(multi, handles[i]);
+    }
+    dstr_free(&url);
+
+    int running = 1;
+    while (running && !os_atomic_load_bool(&s->exiting))
+    {
+        if (curl_multi_perform(multi, &running) != CURLM_OK)
+        {
+            break;
+        }
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(multi, &left)))
+        {
+            for (size_t i = 0; msg->msg == CURLMSG_DONE && i < count; i++)
+            {
+                if (handles[i] == msg->easy_handle)
+                {
+                    score_ingest(&s->ingests.array[i], handles[i], msg->data.result);
+                }
+            }
+        }
+        if (running)
+        {
+            curl_multi_wait(multi, NULL, 0, 100, NULL);
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (handles[i])
+        {
+            curl_multi_remove_handle(multi, handles[i]);
+            curl_easy_cleanup(handles[i]);
+        }
+    }
+    curl_multi_cleanup(multi);
+}
+
+/**
+ * prefer the fastest probed candidate, the startLive address otherwise
+ */
+void choose_ingest(bilibili_service *s)
+{
+    ingest *best = NULL;
+    for (size_t i = 0; i < s->ingests.num; i++)
+    {
+        ingest *in = &s->ingests.array[i];
+        if (in->rtt >= 0 && !in->failures && (!best || in->rtt < best->rtt))
+        {
+            best = in;
+        }
+    }
+    pthread_mutex_lock(&s->task_mutex);
+    bfree(s->ingest_addr);
+    s->ingest_addr = best ? bstrdup(best->url) : NULL;
+    pthread_mutex_unlock(&s->task_mutex);
+}
+
+unsigned long stop_backoff_ms(int attempts)
+{
+    unsigned long delay = STOP_RETRY_MS;
+    for (int i = 1; i < attempts && delay < STOP_RETRY_MAX_MS; i++)
+    {
+        delay *= 2;
+    }
+    return delay < STOP_RETRY_MAX_MS ? delay : STOP_RETRY_MAX_MS;
+}
+
+void run_stop(bilibili_service *s)
+{
+    pthread_mutex_lock(&s->task_mutex);
+    bool first = s->stop_attempts == 0;
+    pthread_mutex_unlock(&s->task_mutex);
+    // written before the call, a hung request must not lose the stop
+    if (first)
+    {
+        save_live_rooms(s);
+    }
+
+    bool done = stop_live(s);
+
+    pthread_mutex_lock(&s->task_mutex);
+    s->stop_pending = !done;
+    s->stop_attempts = done ? 0 : s->stop_attempts + 1;
+    int attempts = s->stop_attempts;
+    s->stop_retry_at = os_gettime_ns() + stop_backoff_ms(attempts) * 1000000ULL;
+    pthread_mutex_unlock(&s->task_mutex);
+    if (done)
+    {
+        if (s->room_id)
+        {
+            save_stop_pending(s->room_id, false);
+        }
+        os_event_signal(s->stopped);
+        metrics_dump();
+    }
+    else
+    {
+        blog(LOG_WARNING, "stopLive failed, retrying in %lu ms", stop_backoff_ms(attempts));
+    }
+}
+
+void start_watch(bilibili_service *s)
+{
+    pthread_mutex_lock(&s->task_mutex);
+    s->watching = true;
+    s->watch_interval = WATCH_FAST_MS;
+    s->watch_at = os_gettime_ns() + WATCH_FAST_MS * 1000000ULL;
+    s->watch_alerted = false;
+    pthread_mutex_unlock(&s->task_mutex);
+    s->watch_live = -1;
+}
+
+/**
+ * void bilibili_live_status(ptr service, int room_id, bool live)
+ */
+void emit_live_status(bilibili_service *s, bool live)
+{
+    struct calldata data;
+    uint8_t stack[128];
+    calldata_init_fixed(&data, stack, sizeof(stack));
+    calldata_set_ptr(&data, "service", s->context);
+    calldata_set_int(&data, "room_id", s->room_id);
+    calldata_set_bool(&data, "live", live);
+    signal_handler_signal(obs_get_signal_handler(), "bilibili_live_status", &data);
+}
+
+/**
+ * void bilibili_room_live(ptr service, int room_id, string addr, string code)
+ * a simulcast room went live, another output can stream to it
+ */
+void emit_room_live(bilibili_service *s, sim_room *r)
+{
+    struct calldata data;
+    calldata_init(&data);
+    calldata_set_ptr(&data, "service", s->context);
+    calldata_set_int(&data, "room_id", r->room_id);
+    calldata_set_string(&data, "addr", r->fields[0]);
+    calldata_set_string(&data, "code", r->fields[1]);
+    signal_handler_signal(obs_get_signal_handler(), "bilibili_room_live", &data);
+    calldata_free(&data);
+}
+
+/**
+ * room_init is the smallest response that carries live_status
+ * return: 1 live, 0 offline, -1 unknown
+ */
+int poll_live_status(bilibili_service *s)
+{
+    http_conn *c = &s->conn[conn_watch];
+    const char *paths[] = {"code", "data.live_status"};
+    char *fields[2] = {NULL};
+    json_stream json;
+    json_stream_init(&json, paths, 2, json_capture_fields, fields);
+    int live = -1;
+
+    if (s->room_id && http_prepare(s, c, endpoint_room_init, NULL))
+    {
+        dstr_catf(&c->url, "?id=%lld", s->room_id);
+        curl_easy_setopt(c->curl, CURLOPT_URL, c->url.array);
+        if (s->watch_etag && s->watch_live != -1)
+        {
+            struct dstr header = {0};
+            dstr_printf(&header, "If-None-Match: %s", s->watch_etag);
+            c->headers = curl_slist_append(c->headers, header.array);
+            curl_easy_setopt(c->curl, CURLOPT_HTTPHEADER, c->headers);
+            dstr_free(&header);
+        }
+        c->json = &json;
+        http_run(s, &c, 1);
+        c->json = NULL;
+        if (c->result == CURLE_OK && c->status == 304)
+        {
+            live = s->watch_live;
+        }
+        else if (c->result == CURLE_OK && json_stream_finish(&json) &&
+            fields[0] && atoi(fields[0]) == 0 && fields[1])
+        {
+            live = atoi(fields[1]) == 1;
+            bfree(s->watch_etag);
+            s->watch_etag = c->etag ? bstrdup(c->etag) : NULL;
+        }
+    }
+    json_free_fields(fields, 2);
+    json_stream_free(&json);
+    return live;
+}
+
+void run_watch(bilibili_service *s)
+{
+    int live = poll_live_status(s);
+    bool streaming = obs_frontend_streaming_active();
+
+    pthread_mutex_lock(&s->task_mutex);
+    if (!s->watching)
+    {
+        pthread_mutex_unlock(&s->task_mutex);
+        return;
+    }
+    bool mismatch = live == 0 && streaming;
+    // look again soon after a failed poll or while something is off
+    if (live == -1 || mismatch)
+    {
+        s->watch_interval = WATCH_FAST_MS;
+    }
+    else if (s->watch_interval < WATCH_SLOW_MS)
+    {
+        s->watch_interval = s->watch_interval * 2 < WATCH_SLOW_MS ? s->watch_interval * 2 : WATCH_SLOW_MS;
+    }
+    s->watch_at = os_gettime_ns() + s->watch_interval * 1000000ULL;
+    bool changed = live != -1 && mismatch != s->watch_alerted;
+    if (changed)
+    {
+        s->watch_alerted = mismatch;
+    }
+    pthread_mutex_unlock(&s->task_mutex);
+    if (live != -1)
+    {
+        s->watch_live = live;
+    }
+
+    if (changed)
+    {
+        if (mismatch)
+        {
+            blog(LOG_WARNING, "room %lld is offline while streaming", s->room_id);
+        }
+        else
+        {
+            blog(LOG_INFO, "room %lld is live again", s->room_id);
+        }
+        emit_live_status(s, !mismatch);
+    }
+}
+
+/**
+ * area id and room id only depend on the settings, fetch them ahead of time
+ * so that stream start only has to wait for startLive
+ */
+void run_tasks(bilibili_service *s, uint32_t tasks)
+{
+    if (tasks & task_prepare)
+    {
+        if (!prepare_ids(s))
+        {
+            blog(LOG_WARNING, "failed to prepare area id and room id");
+        }
+        if (s->room_id)
+        {
+            load_credentials(s);
+        }
+        recover_sim_rooms(s);
+        add_ingest(s, s->addr);
+        pthread_mutex_lock(&s->task_mutex);
+        if (s->stop_pending)
+        {
+            tasks |= task_stop;
+        }
+        pthread_mutex_unlock(&s->task_mutex);
+    }
+    // a start and a stop queued together: only the later one counts
+    pthread_mutex_lock(&s->task_mutex);
+    if ((tasks & task_start) && (tasks & task_stop) && !s->want_live)
+    {
+        tasks &= ~task_start;
+        s->start_requested = false;
+        s->start_ok = false;
+        os_event_signal(s->started);
+    }
+    // cleared by a start that finished after the stop was queued
+    bool stop_pending = s->stop_pending;
+    pthread_mutex_unlock(&s->task_mutex);
+    if ((tasks & task_stop) && !(tasks & task_start) && stop_pending)
+    {
+        run_stop(s);
+    }
+    if (tasks & task_start)
+    {
+        bool ok = (s->room_id && adopt_room(s)) || start_live(s);
+        bool rotated = false;
+        bool orphaned = false;
+        pthread_mutex_lock(&s->task_mutex);
+        s->start_ok = ok;
+        // let the next get_url try again, and wait for startLive then
+        if (!ok)
+        {
+            s->start_requested = false;
+            s->creds_cached = false;
+            // the output already streams on them to a room that is not live
+            orphaned = s->served_cached;
+            s->served_cached = false;
+        }
+        else
+        {
+            // the served address may be a faster ingest, only the key matters
+            rotated = s->served_cached && s->served_code && strcmp(s->served_code, s->code) != 0;
+            s->served_cached = false;
+            // confirmed, the next stream of this session can start on them
+            s->creds_cached = true;
+            // a stop requested during startLive is queued and still has to run
+            if (s->want_live)
+            {
+                s->stop_pending = false;
+                s->stop_attempts = 0;
+            }
+        }
+        pthread_mutex_unlock(&s->task_mutex);
+        os_event_signal(s->started);
+
+        if (ok)
+        {
+            start_watch(s);
+            save_credentials(s->room_id, s->addr, s->code);
+            if (s->auto_stop)
+            {
+                save_live_rooms(s);
+            }
+            // scores are refreshed for the next start, this one uses what is known
+            add_ingest(s, s->addr);
+            tasks |= task_probe;
+        }
+        if (rotated)
+        {
+            reconnect_stream(s);
+        }
+        if (orphaned && obs_frontend_streaming_active())
+        {
+            blog(LOG_ERROR, "startLive failed, stopping the stream started on cached credentials");
+            emit_live_status(s, false);
+            obs_frontend_streaming_stop();
+        }
+    }
+    if (tasks & task_probe)
+    {
+        probe_ingests(s);
+        choose_ingest(s);
+    }
+    if (tasks & task_watch)
+    {
+        run_watch(s);
+    }
+}
+
+void *bilibili_worker(void *data)
+{
+    bilibili_service *s = data;
+    os_set_thread_name("bilibili-service");
+
+    for (;;)
+    {
+        // sleep until new work or the next stop retry or status poll
+        pthread_mutex_lock(&s->task_mutex);
+        uint64_t next = s->stop_pending && s->stop_attempts ? s->stop_retry_at : 0;
+        if (s->watching && (!next || s->watch_at < next))
+        {
+            next = s->watch_at;
+        }
+        pthread_mutex_unlock(&s->task_mutex);
+        uint64_t now = os_gettime_ns();
+        int ret = !next ? os_event_wait(s->task_event) :
+            next > now ? os_event_timedwait(s->task_event, (unsigned long)((next - now) / 1000000) + 1) : ETIMEDOUT;
+        if (os_atomic_load_bool(&s->exiting) || (ret != 0 && ret != ETIMEDOUT))
+        {
+            break;
+        }
+        pthread_mutex_lock(&s->task_mutex);
+        uint32_t tasks = s->tasks;
+        s->tasks = 0;
+        now = os_gettime_ns();
+        if (s->stop_pending && s->stop_attempts && now >= s->stop_retry_at)
+        {
+            tasks |= task_stop;
+        }
+        if (s->watching && now >= s->watch_at)
+        {
+            tasks |= task_watch;
+        }
+        pthread_mutex_unlock(&s->task_mutex);
+
+        pthread_mutex_lock(&s->mutex);
+        obs_data_t *settings = s->pending_settings;
+        s->pending_settings = NULL;
+        pthread_mutex_unlock(&s->mutex);
+        if (settings)
+        {
+            apply_settings(s, settings);
+            obs_data_release(settings);
+        }
+        // requests run unlocked, results go out under task_mutex
+        run_tasks(s, tasks);
+    }
+    return NULL;
+}
+
+void request_start(bilibili_service *s)
+{
+    pthread_mutex_lock(&s->task_mutex);
+    bool queued = !s->start_requested;
+    // never became the streaming service before, ids are still unknown
+    bool prefetch = queued && s->prefetch_pending;
+    // a start still in flight then wins over a stop requested after it
+    s->want_live = true;
+    if (queued)
+    {
+        s->prefetch_pending = false;
+        s->start_requested = true;
+        s->start_ok = false;
+        s->served_cached = false;
+        os_event_reset(s->started);
+    }
+    pthread_mutex_unlock(&s->task_mutex);
+    if (queued)
+    {
+        queue_task(s, prefetch ? task_prepare | task_start : task_start);
+    }
+}
+
+void request_stop(bilibili_service *s)
+{
+    pthread_mutex_lock(&s->task_mutex);
+    s->stop_pending = true;
+    s->want_live = false;
+    s->stop_attempts = 0;
+    s->stop_registered = false;
+    s->watching = false;
+    os_event_reset(s->stopped);
+    pthread_mutex_unlock(&s->task_mutex);
+    queue_task(s, task_stop);
+}
+
+/**
+ * cached: only hand out credentials loaded from disk, startLive may
+ * still be running
+ */
+bool serve_credentials(bilibili_service *s, bool cached)
+{
+    pthread_mutex_lock(&s->task_mutex);
+    bool ok = s->addr && s->code && (!cached || s->creds_cached);
+    if (ok)
+    {
+        s->served_cached = cached;
+        my_strdup(&s->served_addr, s->ingest_addr ? s->ingest_addr : s->addr);
+        my_strdup(&s->served_code, s->code);
+    }
+    pthread_mutex_unlock(&s->task_mutex);
+    return ok;
+}
+
+/**
+ * return: whether startLive finished in time and succeeded
+ */
+bool wait_start(bilibili_service *s)
+{
+    if (!s->worker_valid)
+    {
+        return false;
+    }
+    if (os_event_timedwait(s->started, START_TIMEOUT_MS) != 0)
+    {
+        blog(LOG_ERROR, "startLive timed out");
+        return false;
+    }
+    pthread_mutex_lock(&s->task_mutex);
+    bool ok = s->start_ok;
+    pthread_mutex_unlock(&s->task_mutex);
+    return ok;
+}
+
+void bilibili_frontend_event(enum obs_frontend_event event, void *data)
+{
+    bilibili_service *s = data;
+    if (event == OBS_FRONTEND_EVENT_STREAMING_STARTING)
+    {
+        // start talking to the api while the output is still being set up
+        obs_service_t *current = obs_frontend_get_streaming_service();
+        if (current == s->context)
+        {
+            request_start(s);
+        }
+        pthread_mutex_lock(&s->task_mutex);
+        s->reconnecting = false;
+        pthread_mutex_unlock(&s->task_mutex);
+    }
+    else if (event == OBS_FRONTEND_EVENT_STREAMING_STOPPED)
+    {
+        pthread_mutex_lock(&s->task_mutex);
+        bool reconnecting = s->reconnecting;
+        // the room is still live with fresh credentials, just restart
+        if (!reconnecting)
+        {
+            s->start_requested = false;
+            s->watching = false;
+        }
+        pthread_mutex_unlock(&s->task_mutex);
+        if (reconnecting)
+        {
+            obs_frontend_streaming_start();
+        }
+    }
+    else if (event == OBS_FRONTEND_EVENT_SCENE_CHANGED || event == OBS_FRONTEND_EVENT_PROFILE_CHANGED)
+    {
+        // the frontend sets the streaming service after creating it
+        if (obs_frontend_get_streaming_service() == s->context)
+        {
+            queue_prefetch(s);
+        }
+    }
+    else if (event == OBS_FRONTEND_EVENT_EXIT)
+    {
+        pthread_mutex_lock(&s->task_mutex);
+        bool live = s->stop_registered;
+        pthread_mutex_unlock(&s->task_mutex);
+        if (live)
+        {
+            obs_frontend_remove_event_callback(bilibili_frontend_stop, s);
+            request_stop(s);
+        }
+        // give stopLive a moment, a pending one is retried on the next load
+        pthread_mutex_lock(&s->task_mutex);
+        bool pending = s->stop_pending && s->worker_valid;
+        pthread_mutex_unlock(&s->task_mutex);
+        if (pending && os_event_timedwait(s->stopped, STOP_EXIT_TIMEOUT_MS) != 0)
+        {
+            blog(LOG_WARNING, "stopLive still pending at exit");
+        }
+    }
+}
+
+void bilibili_frontend_stop(enum obs_frontend_event event, void *data)
+{
+    bilibili_service *s = data;
+    if (event == OBS_FRONTEND_EVENT_STREAMING_STOPPED)
+    {
+        pthread_mutex_lock(&s->task_mutex);
+        bool reconnecting = s->reconnecting;
+        pthread_mutex_unlock(&s->task_mutex);
+        if (reconnecting)
+        {
+            return;
+        }
+        obs_frontend_remove_event_callback(bilibili_frontend_stop, data);
+        request_stop(s);
+    }
+}
+
+void register_stop_streaming(bilibili_service *s)
+{
+    if (!s->auto_stop)
+    {
+        return;
+    }
+    pthread_mutex_lock(&s->task_mutex);
+    bool registered = s->stop_registered;
+    s->stop_registered = true;
+    pthread_mutex_unlock(&s->task_mutex);
+    if (!registered)
+    {
+        obs_frontend_add_event_callback(bilibili_frontend_stop, s);
+    }
+}
+
+const char *bilibili_url(void *data)
+{
+    bilibili_service *s = data;
+    request_start(s);
+    register_stop_streaming(s);
+    // get_key follows right away and returns the matching served_code
+    if (!serve_credentials(s, true) && !(wait_start(s) && serve_credentials(s, false)))
+    {
+        return NULL;
+    }
+    blog(LOG_DEBUG, "bilibili url %s", s->served_addr);
+    return s->served_addr;
+}
+
+const char *bilibili_key(void *data)
+{
+    bilibili_service *s = data;
+    if (!s->served_code && !(wait_start(s) && serve_credentials(s, false)))
+    {
+        return NULL;
+    }
+    blog(LOG_DEBUG, "bilibili key %s", s->served_code);
+    return s->served_code;
+}
+
+struct obs_service_info my_service = {
+    .id             = "bilibili_service",
+    .get_name       = bilibili_name,
+    .create         = bilibili_create,
+    .destroy        = bilibili_destroy,
+    .update         = bilibili_update,
+    .get_properties = bilibili_properties,
+    .get_defaults   = bilibili_get_defaults,
+    .get_url        = bilibili_url,
+    .get_key        = bilibili_key,
+};
+
+/**
+ * danmaku transport, the default is plain tcp to the chat server; a local
+ * stand-in server replaying recorded traffic only needs host and port
+ */
+typedef struct danmaku_transport_def {
+    void *(*create)(void);
+    void (*destroy)(void *data);
+    bool (*open)(void *data, const char *host, int port);
+    void (*close)(void *data);
+    bool (*send)(void *data, const char *buf, size_t len);
+    /**
+     * return: bytes read, 0 on timeout, -1 when the connection is gone
+     */
+    int (*recv)(void *data, char *buf, size_t len, int timeout_ms);
+} danmaku_transport;
+
+typedef struct tcp_transport_def {
+    CURL *curl;
+    curl_socket_t sock;
+} tcp_transport;
+
+/**
+ * poll has no FD_SETSIZE limit on the socket number
+ */
+int wait_socket(curl_socket_t sock, bool for_write, int timeout_ms)
+{
+    struct pollfd pfd = {0};
+    pfd.fd = sock;
+    pfd.events = for_write ? POLLOUT : POLLIN;
+    return poll(&pfd, 1, timeout_ms);
+}
+
+void *tcp_create(void)
+{
+    return bzalloc(sizeof(tcp_transport));
+}
+
+void tcp_close(void *data)
+{
+    tcp_transport *t = data;
+    if (t->curl)
+    {
+        curl_easy_cleanup(t->curl);
+        t->curl = NULL;
+    }
+}
+
+void tcp_destroy(void *data)
+{
+    tcp_close(data);
+    bfree(data);
+}
+
+bool tcp_open(void *data, const char *host, int port)
+{
+    tcp_transport *t = data;
+    tcp_close(t);
+    t->curl = curl_easy_init();
+    if (!t->curl)
+    {
+        return false;
+    }
+    struct dstr url = {0};
+    dstr_printf(&url, "http://%s:%d", host, port);
+    if (curl_share)
+    {
+        curl_easy_setopt(t->curl, CURLOPT_SHARE, curl_share);
+    }
+    curl_easy_setopt(t->curl, CURLOPT_URL, url.array);
+    curl_easy_setopt(t->curl, CURLOPT_CONNECT_ONLY, 1L);
+    curl_easy_setopt(t->curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(t->curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(t->curl, CURLOPT_CONNECTTIMEOUT_MS, (long)API_CONNECT_TIMEOUT_MS);
+    CURLcode result = curl_easy_perform(t->curl);
+    dstr_free(&url);
+    if (result != CURLE_OK ||
+        curl_easy_getinfo(t->curl, CURLINFO_ACTIVESOCKET, &t->sock) != CURLE_OK ||
+        t->sock == CURL_SOCKET_BAD)
+    {
+        blog(LOG_WARNING, "danmaku: connect to %s:%d failed: %s", host, port, curl_easy_strerror(result));
+        tcp_close(t);
+        return false;
+    }
+    return true;
+}
+
+bool tcp_send(void *data, const char *buf, size_t len)
+{
+    tcp_transport *t = data;
+    while (len)
+    {
+        size_t sent = 0;
+        CURLcode result = curl_easy_send(t->curl, buf, len, &sent);
+        if (result == CURLE_AGAIN)
+        {
+            if (wait_socket(t->sock, true, API_TIMEOUT_MS) <= 0)
+            {
+                return false;
+            }
+            continue;
+        }
+        if (result != CURLE_OK)
+        {
+            return false;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+int tcp_recv(void *data, char *buf, size_t len, int timeout_ms)
+{
+    tcp_transport *t = data;
+    int ready = wait_socket(t->sock, false, timeout_ms);
+    if (ready <= 0)
+    {
+        return ready;
+    }
+    size_t n = 0;
+    CURLcode result = curl_easy_recv(t->curl, buf, len, &n);
+    if (result == CURLE_AGAIN)
+    {
+        return 0;
+    }
+    // a readable socket without data was closed by the server
+    return result == CURLE_OK && n ? (int)n : -1;
+}
+
+const danmaku_transport tcp_danmaku_transport = {
+    .create  = tcp_create,
+    .destroy = tcp_destroy,
+    .open    = tcp_open,
+    .close   = tcp_close,
+    .send    = tcp_send,
+    .recv    = tcp_recv
+};
+
+/**
+ * the newest messages, older ones are overwritten when the reader falls
+ * behind
+ */
+typedef struct danmaku_msg_def {
+    char user[DANMAKU_USER_MAX];
+    char text[DANMAKU_TEXT_MAX];
+} danmaku_msg;
+typedef struct danmaku_ring_def {
+    pthread_mutex_t mutex;
+    danmaku_msg msgs[DANMAKU_RING_SIZE];
+    // messages written so far
+    uint64_t head;
+} danmaku_ring;
+
+/**
+ * info is [meta[], text, [uid, uname, ...], ...]
+ */
+typedef struct danmaku_parse_def {
+    bool is_danmu;
+    int outer;
+    int inner;
+    danmaku_msg msg;
+} danmaku_parse;
+
+const char *danmaku_paths[] = {"cmd", "info[]", "info[][]"};
+
+/**
+ * one reader thread and everything it touches, stopping only signals it so
+ * that the ui never waits for a blocking connect or read
+ */
+typedef struct danmaku_session_def {
+    danmaku_ring ring;
+    long long room_id;
+    char *host;
+    int port;
+    const danmaku_transport *transport;
+    void *transport_data;
+    pthread_t thread;
+    os_event_t *stop;
+    // set by the thread when it is about to return, the join is then instant
+    volatile bool done;
+
+    json_stream json;
+    danmaku_parse parse;
+    bool warned_compressed;
+} danmaku_session;
+typedef struct danmaku_source_def {
+    obs_source_t *context;
+    obs_source_t *text;
+    // ring position already handed to the text source
+    uint64_t shown;
+    float since_update;
+    int lines;
+
+    long long room_id;
+    char *host;
+    int port;
+    // swapped by update while tick reads the ring
+    pthread_mutex_t mutex;
+    danmaku_session *session;
+} danmaku_source;
+// stopped sessions whose thread was not joined yet
+DARRAY(danmaku_session *) retired_sessions;
+pthread_mutex_t sessions_mutex;
+
+uint32_t get_be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void put_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+bool danmaku_send(danmaku_session *d, uint32_t op, const char *body, size_t len)
+{
+    uint8_t header[DANMAKU_HEADER_SIZE];
+    put_be32(header, (uint32_t)(DANMAKU_HEADER_SIZE + len));
+    header[4] = 0;
+    header[5] = DANMAKU_HEADER_SIZE;
+    header[6] = 0;
+    header[7] = 1;
+    put_be32(header + 8, op);
+    put_be32(header + 12, 1);
+    return d->transport->send(d->transport_data, (const char *)header, sizeof(header)) &&
+        (!len || d->transport->send(d->transport_data, body, len));
+}
+
+/**
+ * cut at a character boundary
+ */
+void copy_utf8(char *dst, size_t size, const char *src)
+{
+    size_t len = strlen(src);
+    if (len >= size)
+    {
+        len = size - 1;
+        while (len && ((uint8_t)src[len] & 0xC0) == 0x80)
+        {
+            len--;
+        }
+    }
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+void danmaku_parse_value(void *param, size_t index, const char *value)
+{
+    danmaku_parse *p = param;
+    if (index == 0)
+    {
+        p->is_danmu = value && strncmp(value, "DANMU_MSG", 9) == 0;
+    }
+    else if (index == 1)
+    {
+        if (p->outer == 1 && value)
+        {
+            copy_utf8(p->msg.text, sizeof(p->msg.text), value);
+        }
+        p->outer++;
+        p->inner = 0;
+    }
+    else if (index == 2)
+    {
+        if (p->outer == 2 && p->inner == 1 && value)
+        {
+            copy_utf8(p->msg.user, sizeof(p->msg.user), value);
+        }
+        p->inner++;
+    }
+}
+
+void danmaku_push(danmaku_ring *ring, const danmaku_msg *msg)
+{
+    pthread_mutex_lock(&ring->mutex);
+    ring->msgs[ring->head % DANMAKU_RING_SIZE] = *msg;
+    ring->head++;
+    pthread_mutex_unlock(&ring->mutex);
+}
+
+/**
+ * the body is parsed where it was received, only the extracted text is
+ * copied into the ring
+ */
+void danmaku_message(danmaku_session *d, const char *body, size_t len)
+{
+    memset(&d->parse, 0, sizeof(d->parse));
+    json_stream_reset(&d->json);
+    if (json_stream_feed(&d->json, body, len) && json_stream_finish(&d->json) &&
+        d->parse.is_danmu && d->parse.msg.text[0])
+    {
+        danmaku_push(&d->ring, &d->parse.msg);
+    }
+}
+
+/**
+ * return: bytes of complete packets consumed, -1 on a malformed stream
+ */
+int danmaku_parse_packets(danmaku_session *d, const char *buf, size_t len)
+{
+    size_t pos = 0;
+    while (len - pos >= DANMAKU_HEADER_SIZE)
+    {
+        const uint8_t *header = (const uint8_t *)buf + pos;
+        uint32_t packet_len = get_be32(header);
+        uint16_t header_len = (uint16_t)(header[4] << 8 | header[5]);
+        uint16_t protover = (uint16_t)(header[6] << 8 | header[7]);
+        uint32_t op = get_be32(header + 8);
+        if (header_len < DANMAKU_HEADER_SIZE || packet_len < header_len || packet_len > DANMAKU_RECV_BUFFER)
+        {
+            return -1;
+        }
+        if (len - pos < packet_len)
+        {
+            break;
+        }
+        if (op == DANMAKU_OP_MESSAGE)
+        {
+            // only asked for protover 1, compressed batches cannot be read here
+            if (protover >= 2)
+            {
+                if (!d->warned_compressed)
+                {
+                    blog(LOG_WARNING, "danmaku: skipping compressed packets");
+                    d->warned_compressed = true;
+                }
+            }
+            else
+            {
+                danmaku_message(d, buf + pos + header_len, packet_len - header_len);
+            }
+        }
+        pos += packet_len;
+    }
+    return (int)pos;
+}
+
+bool danmaku_join(danmaku_session *d)
+{
+    if (!d->transport->open(d->transport_data, d->host, d->port))
+    {
+        return false;
+    }
+    char body[256];
+    int len = snprintf(body, sizeof(body),
+        "{\"uid\":0,\"roomid\":%lld,\"protover\":1,\"platform\":\"web\",\"clientver\":\"1.4.0\"}", d->room_id);
+    if (!danmaku_send(d, DANMAKU_OP_AUTH, body, (size_t)len))
+    {
+        d->transport->close(d->transport_data);
+        return false;
+    }
+    blog(LOG_INFO, "danmaku: joined room %lld", d->room_id);
+    return true;
+}
+
+void *danmaku_thread(void *data)
+{
+    danmaku_session *d = data;
+    os_set_thread_name("bilibili-danmaku");
+    char *buf = bmalloc(DANMAKU_RECV_BUFFER);
+    size_t used = 0;
+    bool connected = false;
+    unsigned long retry = DANMAKU_RETRY_MS;
+    uint64_t heartbeat = 0;
+
+    while (os_event_try(d->stop) == EAGAIN)
+    {
+        if (!connected)
+        {
+            connected = danmaku_join(d);
+            if (!connected)
+            {
+                os_event_timedwait(d->stop, retry);
+                retry = retry * 2 < DANMAKU_RETRY_MAX_MS ? retry * 2 : DANMAKU_RETRY_MAX_MS;
+                continue;
+            }
+            retry = DANMAKU_RETRY_MS;
+            used = 0;
+            heartbeat = 0;
+        }
+        uint64_t now = os_gettime_ns();
+        if (now - heartbeat >= DANMAKU_HEARTBEAT_MS * 1000000ULL)
+        {
+            heartbeat = now;
+            connected = danmaku_send(d, DANMAKU_OP_HEARTBEAT, NULL, 0);
+        }
+
+        int n = connected ? d->transport->recv(d->transport_data, buf + used, DANMAKU_RECV_BUFFER - used, 500) : -1;
+        int consumed = n > 0 ? danmaku_parse_packets(d, buf, used + n) : 0;
+        if (n < 0 || consumed < 0)
+        {
+            blog(LOG_WARNING, "danmaku: connection lost, reconnecting");
+            d->transport->close(d->transport_data);
+            connected = false;
+            continue;
+        }
+        if (n > 0)
+        {
+            used = used + n - consumed;
+            memmove(buf, buf + consumed, used);
+        }
+    }
+    d->transport->close(d->transport_data);
+    bfree(buf);
+    os_atomic_set_bool(&d->done, true);
+    return NULL;
+}
+
+void danmaku_session_free(danmaku_session *d)
+{
+    d->transport->destroy(d->transport_data);
+    json_stream_free(&d->json);
+    os_event_destroy(d->stop);
+    pthread_mutex_destroy(&d->ring.mutex);
+    bfree(d->host);
+    bfree(d);
+}
+
+/**
+ * wait: join every thread, only at unload, otherwise just the finished ones
+ */
+void reap_sessions(bool wait)
+{
+    pthread_mutex_lock(&sessions_mutex);
+    for (size_t i = retired_sessions.num; i > 0; i--)
+    {
+        danmaku_session *d = retired_sessions.array[i - 1];
+        if (wait || os_atomic_load_bool(&d->done))
+        {
+            pthread_join(d->thread, NULL);
+            danmaku_session_free(d);
+            da_erase(retired_sessions, i - 1);
+        }
+    }
+    pthread_mutex_unlock(&sessions_mutex);
+}
+
+void danmaku_stop(danmaku_source *d)
+{
+    pthread_mutex_lock(&d->mutex);
+    danmaku_session *session = d->session;
+    d->session = NULL;
+    pthread_mutex_unlock(&d->mutex);
+    if (session)
+    {
+        os_event_signal(session->stop);
+        pthread_mutex_lock(&sessions_mutex);
+        da_push_back(retired_sessions, &session);
+        pthread_mutex_unlock(&sessions_mutex);
+    }
+    reap_sessions(false);
+}
+
+void danmaku_start(danmaku_source *d)
+{
+    if (!d->room_id || !d->host || !*d->host)
+    {
+        return;
+    }
+    danmaku_session *session = bzalloc(sizeof(danmaku_session));
+    session->room_id = d->room_id;
+    session->host = bstrdup(d->host);
+    session->port = d->port;
+    session->transport = &tcp_danmaku_transport;
+    session->transport_data = session->transport->create();
+    json_stream_init(&session->json, danmaku_paths, 3, danmaku_parse_value, &session->parse);
+    pthread_mutex_init_value(&session->ring.mutex);
+    if (pthread_mutex_init(&session->ring.mutex, NULL) != 0 ||
+        os_event_init(&session->stop, OS_EVENT_TYPE_MANUAL) != 0 ||
+        pthread_create(&session->thread, NULL, danmaku_thread, session) != 0)
+    {
+        blog(LOG_ERROR, "failed to start danmaku reader");
+        danmaku_session_free(session);
+        return;
+    }
+    pthread_mutex_lock(&d->mutex);
+    d->session = session;
+    pthread_mutex_unlock(&d->mutex);
+}
+
+const char *danmaku_name(void *unused)
+{
+    return "Bilibili 弹幕";
+}
+
+void danmaku_update(void *data, obs_data_t *settings)
+{
+    danmaku_source *d = data;
+    long long room_id = obs_data_get_int(settings, "room_id");
+    const char *host = obs_data_get_string(settings, "host");
+    int port = (int)obs_data_get_int(settings, "port");
+    d->lines = (int)obs_data_get_int(settings, "lines");
+    if (d->lines < 1)
+    {
+        d->lines = 1;
+    }
+    // force a redraw with the new line count
+    d->shown = 0;
+
+    bool reconnect = room_id != d->room_id || port != d->port || !d->host || strcmp(host, d->host) != 0;
+    if (reconnect)
+    {
+        danmaku_stop(d);
+        d->room_id = room_id;
+        d->port = port;
+        my_strdup(&d->host, host);
+        danmaku_start(d);
+    }
+}
+
+void *danmaku_create(obs_data_t *settings, obs_source_t *source)
+{
+    danmaku_source *d = bzalloc(sizeof(danmaku_source));
+    d->context = source;
+    pthread_mutex_init_value(&d->mutex);
+    if (pthread_mutex_init(&d->mutex, NULL) != 0)
+    {
+        blog(LOG_ERROR, "failed to create danmaku sync objects");
+    }
+
+#ifdef _WIN32
+    const char *text_id = "text_gdiplus";
+#else
+    const char *text_id = "text_ft2_source";
+#endif
+    obs_data_t *text_settings = obs_data_create();
+    d->text = obs_source_create_private(text_id, "danmaku text", text_settings);
+    obs_data_release(text_settings);
+
+    danmaku_update(d, settings);
+    return d;
+}
+
+void danmaku_destroy(void *data)
+{
+    danmaku_source *d = data;
+    danmaku_stop(d);
+    pthread_mutex_destroy(&d->mutex);
+    obs_source_release(d->text);
+    bfree(d->host);
+    bfree(d);
+}
+
+/**
+ * the text source re-rasterizes only here, at most every
+ * DANMAKU_UPDATE_INTERVAL, no matter how fast messages arrive
+ */
+void danmaku_tick(void *data, float seconds)
+{
+    danmaku_source *d = data;
+    d->since_update += seconds;
+    if (d->since_update < DANMAKU_UPDATE_INTERVAL || !d->text)
+    {
+        return;
+    }
+    d->since_update = 0.0f;
+
+    pthread_mutex_lock(&d->mutex);
+    danmaku_ring *ring = d->session ? &d->session->ring : NULL;
+    if (!ring)
+    {
+        pthread_mutex_unlock(&d->mutex);
+        return;
+    }
+    pthread_mutex_lock(&ring->mutex);
+    uint64_t head = ring->head;
+    if (head == d->shown)
+    {
+        pthread_mutex_unlock(&ring->mutex);
+        pthread_mutex_unlock(&d->mutex);
+        return;
+    }
+    uint64_t count = (uint64_t)d->lines;
+    if (count > DANMAKU_RING_SIZE)
+    {
+        count = DANMAKU_RING_SIZE;
+    }
+    uint64_t first = head > count ? head - count : 0;
+    struct dstr text = {0};
+    for (uint64_t i = first; i < head; i++)
+    {
+        danmaku_msg *msg = &ring->msgs[i % DANMAKU_RING_SIZE];
+        dstr_catf(&text, "%s%s: %s", i == first ? "" : "\n", msg->user, msg->text);
+    }
+    pthread_mutex_unlock(&ring->mutex);
+    pthread_mutex_unlock(&d->mutex);
+    d->shown = head;
+
+    obs_data_t *settings = obs_data_create();
+    obs_data_set_string(settings, "text", text.array ? text.array : "");
+    obs_source_update(d->text, settings);
+    obs_data_release(settings);
+    dstr_free(&text);
+}
+
+void danmaku_render(void *data, gs_effect_t *effect)
+{
+    danmaku_source *d = data;
+    if (d->text)
+    {
+        obs_source_video_render(d->text);
+    }
+}
+
+uint32_t danmaku_width(void *data)
+{
+    danmaku_source *d = data;
+    return d->text ? obs_source_get_width(d->text) : 0;
+}
+
+uint32_t danmaku_height(void *data)
+{
+    danmaku_source *d = data;
+    return d->text ? obs_source_get_height(d->text) : 0;
+}
+
+void danmaku_enum_sources(void *data, obs_source_enum_proc_t enum_callback, void *param)
+{
+    danmaku_source *d = data;
+    if (d->text)
+    {
+        enum_callback(d->context, d->text, param);
+    }
+}
+
+obs_properties_t *danmaku_properties(void *unused)
+{
+    obs_properties_t *ppts = obs_properties_create();
+    obs_properties_add_int(ppts, "room_id", "房间号", 0, INT_MAX, 1);
+    obs_properties_add_int(ppts, "lines", "显示行数", 1, DANMAKU_RING_SIZE, 1);
+    obs_properties_add_text(ppts, "host", "弹幕服务器", OBS_TEXT_DEFAULT);
+    obs_properties_add_int(ppts, "port", "端口", 1, 65535, 1);
+    return ppts;
+}
+
+void danmaku_defaults(obs_data_t *settings)
+{
+    obs_data_set_default_int(settings, "lines", 10);
+    obs_data_set_default_string(settings, "host", DANMAKU_HOST);
+    obs_data_set_default_int(settings, "port", DANMAKU_PORT);
+}
+
+struct obs_source_info danmaku_source_info = {
+    .id                  = "bilibili_danmaku",
+    .type                = OBS_SOURCE_TYPE_INPUT,
+    .output_flags        = OBS_SOURCE_VIDEO,
+    .get_name            = danmaku_name,
+    .create              = danmaku_create,
+    .destroy             = danmaku_destroy,
+    .update              = danmaku_update,
+    .get_width           = danmaku_width,
+    .get_height          = danmaku_height,
+    .video_tick          = danmaku_tick,
+    .video_render        = danmaku_render,
+    .enum_active_sources = danmaku_enum_sources,
+    .get_properties      = danmaku_properties,
+    .get_defaults        = danmaku_defaults
+};
+
+bool obs_module_load(void)
+{
+    init_curl_share();
+    area_index_init();
+    pthread_mutex_init(&credentials_mutex, NULL);
+    pthread_mutex_init(&metrics_mutex, NULL);
+    pthread_mutex_init(&rooms_mutex, NULL);
+    pthread_mutex_init(&sessions_mutex, NULL);
+    signal_handler_add(obs_get_signal_handler(), "void bilibili_live_status(ptr service, int room_id, bool live)");
+    signal_handler_add(obs_get_signal_handler(), "void bilibili_room_live(ptr service, int room_id, string addr, string code)");
+    obs_register_service(&my_service);
+    obs_register_source(&danmaku_source_info);
+    return true;
+}
+
+void obs_module_unload(void)
+{
+    // readers of removed danmaku sources may still be in a connect
+    reap_sessions(true);
+    da_free(retired_sessions);
+    pthread_mutex_destroy(&sessions_mutex);
+    metrics_dump();
+    area_index_free();
+    pthread_mutex_destroy(&credentials_mutex);
+    pthread_mutex_destroy(&metrics_mutex);
+    for (size_t i = 0; i < live_rooms.num; i++)
+    {
+        bfree(live_rooms.array[i].addr);
+        bfree(live_rooms.array[i].code);
+    }
+    da_free(live_rooms);
+    pthread_mutex_destroy(&rooms_mutex);
+    free_curl_share();
 }
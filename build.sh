@@ -0,0 +1,7 @@
+#!/bin/sh
+# linux counterpart of build.bat, links the installed obs and curl
+# (needs the obs and curl development packages). Only the modules are
+# built; they are exercised inside a running obs, there is no headless
+# runtime or test target.
+gcc -g -fPIC -Iinclude/libobs -Iinclude/obs-frontend-api -shared pixel-switcher-filter.c -lobs -lobs-frontend-api -o pixel-switcher-filter.so
+gcc -g -fPIC -Iinclude/obs-frontend-api -Iinclude/libobs -shared bilibili-service.c -lobs -lobs-frontend-api -lcurl -lpthread -o bilibili-service.so
@@ -1,7 +1,25 @@
 #include <obs-module.h>
 #include <obs-frontend-api.h>
+#include <util/threading.h>
+#include <util/darray.h>
 #include <stdio.h>
 
+#define READBACK_BUDGET_PER_FRAME 1
+#define ANALYSIS_SCALE_480P 0
+// smallest analysis height the time panel probes still resolve at
+#define TIME_PANEL_MIN_HEIGHT 360
+#define SURFACE_POOL_MAX 8
+// async frames may pause this long before offscreen_render pulls them
+#define ASYNC_IDLE_NS 200000000ULL
+// idle stage surfaces beyond this are freed, oldest first
+#define SURFACE_POOL_MAX_BYTES (64 * 1024 * 1024)
+// seconds a new source size must hold before textures are reallocated
+#define RESIZE_DEBOUNCE 0.5f
+#define BORDER_THRESHOLD 16
+#define BORDER_SAMPLES 32
+// analysed frames that must agree on the bars before the remap is taken
+#define VIEWPORT_STABLE_SAMPLES 5
+
 OBS_DECLARE_MODULE();
 typedef enum now_state_def {
     state_playing,
@@ -12,13 +30,39 @@ struct filter_data_def {
     gs_texrender_t *render;
     gs_stagesurf_t *copy;
     uint32_t counter;
+    // frame the interval counter last advanced on
+    uint64_t counted_frame;
+    uint32_t phase;
     uint32_t cx;
     uint32_t cy;
+    uint32_t pending_cx;
+    uint32_t pending_cy;
+    float pending_since;
     uint32_t linesize;
     uint8_t *ptr;
+    struct obs_source_frame *frame;
+    uint32_t frame_counter;
+    volatile bool async_active;
+    // frame time filter_video last ran for a render that was not ours
+    uint64_t filtered_at;
+    // offscreen_render is pulling the async source through
+    bool pulling;
     uint8_t near;
     bool target_valid;
 
+    bool auto_viewport;
+    volatile bool calibrate;
+    uint32_t viewport_cx;
+    uint32_t viewport_cy;
+    float vx;
+    float vy;
+    float vw;
+    float vh;
+    // left, top, right, bottom, cx, cy of the last detection and how often
+    // it was seen in a row
+    uint32_t candidate[6];
+    uint32_t candidate_hits;
+
     bool last_is_time_panel;
     bool is_time_panel;
     float time_panel_begin;
@@ -26,9 +70,15 @@ struct filter_data_def {
 
     now_state state;
 
+    // analyze from the main render loop instead of the filter's own render
+    bool offscreen;
+    // parent kept showing while offscreen analysis runs
+    obs_source_t *shown_parent;
+
     char* other_scene;
     char* gaming_scene;
     uint32_t interval;
+    uint32_t scale;
     uint32_t before_gaming;
     uint32_t before_other;
 };
@@ -40,24 +90,195 @@ struct mRGB_def {
     uint8_t rev;
 };
 typedef struct mRGB_def mRGB;
+/**
+ * shared by every filter instance, only touched from the graphics thread
+ * except next_phase
+ */
+struct readback_scheduler_def {
+    volatile long next_phase;
+    uint64_t frame_time;
+    uint32_t used;
+};
+typedef struct readback_scheduler_def readback_scheduler;
+readback_scheduler scheduler = {0};
+struct pooled_stagesurf_def {
+    uint32_t cx;
+    uint32_t cy;
+    enum gs_color_format format;
+    gs_stagesurf_t *surf;
+};
+typedef struct pooled_stagesurf_def pooled_stagesurf;
+/**
+ * idle surfaces shared by every filter instance, only touched inside
+ * obs_enter_graphics so the graphics context serializes access
+ */
+struct surface_pool_def {
+    DARRAY(pooled_stagesurf) stagesurfs;
+    uint64_t stagesurf_bytes;
+    DARRAY(gs_texrender_t *) renders;
+};
+typedef struct surface_pool_def surface_pool;
+surface_pool pool = {0};
 mRGB RGB_BLACK = {0, 0, 0, 0};
 mRGB RGB_WHITE = {255, 255, 255, 0};
 void my_source_update(void *data, obs_data_t *settings);
+void reset_viewport(filter_data *f);
+void offscreen_render(void *param, uint32_t cx, uint32_t cy);
 
 void elog(const char* s)
 {
     blog(LOG_DEBUG, "%s", s);
 }
 
-void reset_textures(filter_data *f)
+/**
+ * return: whether a readback may still be done in the current frame
+ */
+bool scheduler_acquire(void)
+{
+    uint64_t t = obs_get_video_frame_time();
+    if (t != scheduler.frame_time)
+    {
+        scheduler.frame_time = t;
+        scheduler.used = 0;
+    }
+    if (scheduler.used >= READBACK_BUDGET_PER_FRAME)
+    {
+        return false;
+    }
+    scheduler.used++;
+    return true;
+}
+
+uint64_t stagesurf_bytes(const pooled_stagesurf *p)
+{
+    return (uint64_t)p->cx * p->cy * gs_get_format_bpp(p->format) / 8;
+}
+
+gs_stagesurf_t *pool_acquire_stagesurf(uint32_t cx, uint32_t cy, enum gs_color_format format)
+{
+    for (size_t i = 0; i < pool.stagesurfs.num; i++)
+    {
+        pooled_stagesurf *p = &pool.stagesurfs.array[i];
+        if (p->cx == cx && p->cy == cy && p->format == format)
+        {
+            gs_stagesurf_t *surf = p->surf;
+            pool.stagesurf_bytes -= stagesurf_bytes(p);
+            da_erase(pool.stagesurfs, i);
+            return surf;
+        }
+    }
+    return gs_stagesurface_create(cx, cy, format);
+}
+
+void pool_release_stagesurf(gs_stagesurf_t *surf)
+{
+    if (!surf)
+    {
+        return;
+    }
+    pooled_stagesurf p = {
+        .cx = gs_stagesurface_get_width(surf),
+        .cy = gs_stagesurface_get_height(surf),
+        .format = gs_stagesurface_get_color_format(surf),
+        .surf = surf
+    };
+    uint64_t bytes = stagesurf_bytes(&p);
+    if (bytes > SURFACE_POOL_MAX_BYTES)
+    {
+        gs_stagesurface_destroy(surf);
+        return;
+    }
+    // sizes left behind by a window resize are rarely asked for again
+    while (pool.stagesurfs.num && (pool.stagesurfs.num >= SURFACE_POOL_MAX ||
+        pool.stagesurf_bytes + bytes > SURFACE_POOL_MAX_BYTES))
+    {
+        pool.stagesurf_bytes -= stagesurf_bytes(&pool.stagesurfs.array[0]);
+        gs_stagesurface_destroy(pool.stagesurfs.array[0].surf);
+        da_erase(pool.stagesurfs, 0);
+    }
+    pool.stagesurf_bytes += bytes;
+    da_push_back(pool.stagesurfs, &p);
+}
+
+gs_texrender_t *pool_acquire_render(void)
+{
+    if (pool.renders.num)
+    {
+        gs_texrender_t *render = pool.renders.array[pool.renders.num - 1];
+        da_pop_back(pool.renders);
+        return render;
+    }
+    return gs_texrender_create(GS_RGBA, GS_ZS_NONE);
+}
+
+void pool_release_render(gs_texrender_t *render)
+{
+    if (!render)
+    {
+        return;
+    }
+    if (pool.renders.num >= SURFACE_POOL_MAX)
+    {
+        gs_texrender_destroy(render);
+        return;
+    }
+    gs_texrender_reset(render);
+    da_push_back(pool.renders, &render);
+}
+
+void pool_free(void)
 {
     obs_enter_graphics();
-    if (f->copy)
+    for (size_t i = 0; i < pool.stagesurfs.num; i++)
+    {
+        gs_stagesurface_destroy(pool.stagesurfs.array[i].surf);
+    }
+    for (size_t i = 0; i < pool.renders.num; i++)
     {
-        gs_stagesurface_destroy(f->copy);        
+        gs_texrender_destroy(pool.renders.array[i]);
     }
-    f->copy = gs_stagesurface_create(f->cx, f->cy, GS_RGBA);
     obs_leave_graphics();
+    da_free(pool.stagesurfs);
+    da_free(pool.renders);
+    pool.stagesurf_bytes = 0;
+}
+
+void reset_textures(filter_data *f)
+{
+    obs_enter_graphics();
+    pool_release_stagesurf(f->copy);
+    f->copy = pool_acquire_stagesurf(f->cx, f->cy, GS_RGBA);
+    obs_leave_graphics();
+}
+
+/**
+ * cx, cy: base size in, analysis size out
+ */
+void analysis_size(filter_data *f, uint32_t *cx, uint32_t *cy)
+{
+    uint32_t h = *cy;
+    if (f->scale == ANALYSIS_SCALE_480P)
+    {
+        h = 480;
+    }
+    else if (f->scale > 1)
+    {
+        h = *cy / f->scale;
+    }
+    if (h < TIME_PANEL_MIN_HEIGHT)
+    {
+        h = TIME_PANEL_MIN_HEIGHT;
+    }
+    if (h >= *cy)
+    {
+        return;
+    }
+    *cx = (uint32_t)((uint64_t)*cx * h / *cy);
+    *cy = h;
+    if (!*cx)
+    {
+        *cx = 1;
+    }
 }
 
 void check_size(filter_data *f)
@@ -78,13 +299,33 @@ void check_size(filter_data *f)
     {
         return;
     }
+    analysis_size(f, &cx, &cy);
 
-    if (cx != f->cx || cy != f->cy) {
-        f->cx = cx;
-        f->cy = cy;
-        reset_textures(f);
+    if (cx == f->cx && cy == f->cy) {
+        f->pending_cx = 0;
+        f->pending_cy = 0;
         return;
     }
+    // keep the current surface while a window is still being resized
+    if (f->copy)
+    {
+        if (cx != f->pending_cx || cy != f->pending_cy)
+        {
+            f->pending_cx = cx;
+            f->pending_cy = cy;
+            f->pending_since = f->time;
+            return;
+        }
+        if (f->time - f->pending_since < RESIZE_DEBOUNCE)
+        {
+            return;
+        }
+    }
+    f->cx = cx;
+    f->cy = cy;
+    f->pending_cx = 0;
+    f->pending_cy = 0;
+    reset_textures(f);
 }
 
 void draw_render(gs_texrender_t *render, uint32_t cx, uint32_t cy)
@@ -112,14 +353,18 @@ void *my_source_create(obs_data_t *settings, obs_source_t *source)
     elog("filter create");
     filter_data *f = bzalloc(sizeof(*f));
     f->source = source;
+    f->phase = os_atomic_inc_long(&scheduler.next_phase) - 1;
     f->counter = 0;
     f->near = 1;
     f->state = state_other;
+    reset_viewport(f);
+    // scale has to be known before the first surface is sized
+    my_source_update(f, settings);
     obs_enter_graphics();
-    f->render = gs_texrender_create(GS_RGBA, GS_ZS_NONE);
+    f->render = pool_acquire_render();
     check_size(f);
     obs_leave_graphics();
-    my_source_update(f, settings);
+    obs_add_main_render_callback(offscreen_render, f);
     return f;
 }
 
@@ -127,12 +372,10 @@ void my_source_destroy(void* data)
 {
     elog("filter destroy");
     filter_data *f = data;
+    obs_remove_main_render_callback(offscreen_render, f);
     obs_enter_graphics();
-    gs_texrender_destroy(f->render);
-    if (f->copy)
-    {
-        gs_stagesurface_destroy(f->copy);
-    }
+    pool_release_render(f->render);
+    pool_release_stagesurf(f->copy);
     obs_leave_graphics();
 
     bfree(f->other_scene);
@@ -149,16 +392,37 @@ void my_source_update(void *data, obs_data_t *settings)
     f->other_scene = bstrdup(obs_data_get_string(settings, "other"));
     f->gaming_scene = bstrdup(obs_data_get_string(settings, "gaming"));
     f->interval = obs_data_get_int(settings, "interval");
+    f->scale = obs_data_get_int(settings, "scale");
+    f->auto_viewport = obs_data_get_bool(settings, "auto_viewport");
+    f->offscreen = obs_data_get_bool(settings, "offscreen");
+    if (!f->auto_viewport)
+    {
+        reset_viewport(f);
+        f->viewport_cx = 0;
+        f->viewport_cy = 0;
+    }
+    if (f->interval)
+    {
+        f->counter = f->phase % f->interval;
+    }
     f->before_gaming = obs_data_get_int(settings, "before_gaming");
     f->before_other = obs_data_get_int(settings, "before_other");
 }
 
+/**
+ * gdi+ text on windows, freetype text elsewhere, both take "text"
+ */
+bool is_text_source(const char *id)
+{
+    return strcmp("text_gdiplus", id) == 0 || strcmp("text_ft2_source", id) == 0;
+}
+
 void output(const char *str, const char *src)
 {
     obs_source_t *s = obs_get_source_by_name(src);
     if (s)
     {
-        if (strcmp("text_gdiplus", obs_source_get_id(s)) == 0)
+        if (is_text_source(obs_source_get_id(s)))
         {
             obs_data_t *settings = obs_data_create();
             obs_data_set_string(settings, "text", str);
@@ -174,8 +438,105 @@ int round_int(float x)
     return x + 0.5;
 }
 
+bool is_frame_supported(enum video_format format)
+{
+    switch (format)
+    {
+        case VIDEO_FORMAT_I420:
+        case VIDEO_FORMAT_NV12:
+        case VIDEO_FORMAT_YUY2:
+        case VIDEO_FORMAT_YVYU:
+        case VIDEO_FORMAT_UYVY:
+        case VIDEO_FORMAT_I444:
+        case VIDEO_FORMAT_RGBA:
+        case VIDEO_FORMAT_BGRA:
+        case VIDEO_FORMAT_BGRX:
+            return true;
+        default:
+            return false;
+    }
+}
+
+uint8_t clamp_u8(float v)
+{
+    if (v < 0.0f) return 0;
+    if (v > 1.0f) return 255;
+    return (uint8_t)(v * 255.0f + 0.5f);
+}
+
+/**
+ * yuv: 0-255 per channel, converted with the frame's own color matrix
+ */
+mRGB yuv_to_rgb(const float *m, uint8_t y, uint8_t u, uint8_t v)
+{
+    float fy = y / 255.0f;
+    float fu = u / 255.0f;
+    float fv = v / 255.0f;
+    mRGB r;
+    r.r = clamp_u8(m[0] * fy + m[1] * fu + m[2] * fv + m[3]);
+    r.g = clamp_u8(m[4] * fy + m[5] * fu + m[6] * fv + m[7]);
+    r.b = clamp_u8(m[8] * fy + m[9] * fu + m[10] * fv + m[11]);
+    r.rev = 0;
+    return r;
+}
+
+mRGB get_frame_point_abs(struct obs_source_frame *frame, uint32_t x, uint32_t y)
+{
+    uint8_t *p;
+    mRGB r = RGB_BLACK;
+    if (frame->flip)
+    {
+        y = frame->height - 1 - y;
+    }
+    switch (frame->format)
+    {
+        case VIDEO_FORMAT_I420:
+            return yuv_to_rgb(frame->color_matrix,
+                frame->data[0][y * frame->linesize[0] + x],
+                frame->data[1][(y / 2) * frame->linesize[1] + x / 2],
+                frame->data[2][(y / 2) * frame->linesize[2] + x / 2]);
+        case VIDEO_FORMAT_I444:
+            return yuv_to_rgb(frame->color_matrix,
+                frame->data[0][y * frame->linesize[0] + x],
+                frame->data[1][y * frame->linesize[1] + x],
+                frame->data[2][y * frame->linesize[2] + x]);
+        case VIDEO_FORMAT_NV12:
+            p = frame->data[1] + (y / 2) * frame->linesize[1] + (x / 2) * 2;
+            return yuv_to_rgb(frame->color_matrix,
+                frame->data[0][y * frame->linesize[0] + x], p[0], p[1]);
+        case VIDEO_FORMAT_YUY2:
+            p = frame->data[0] + y * frame->linesize[0] + (x / 2) * 4;
+            return yuv_to_rgb(frame->color_matrix, p[(x & 1) * 2], p[1], p[3]);
+        case VIDEO_FORMAT_YVYU:
+            p = frame->data[0] + y * frame->linesize[0] + (x / 2) * 4;
+            return yuv_to_rgb(frame->color_matrix, p[(x & 1) * 2], p[3], p[1]);
+        case VIDEO_FORMAT_UYVY:
+            p = frame->data[0] + y * frame->linesize[0] + (x / 2) * 4;
+            return yuv_to_rgb(frame->color_matrix, p[1 + (x & 1) * 2], p[0], p[2]);
+        case VIDEO_FORMAT_RGBA:
+            p = frame->data[0] + y * frame->linesize[0] + x * 4;
+            r.r = p[0];
+            r.g = p[1];
+            r.b = p[2];
+            return r;
+        case VIDEO_FORMAT_BGRA:
+        case VIDEO_FORMAT_BGRX:
+            p = frame->data[0] + y * frame->linesize[0] + x * 4;
+            r.r = p[2];
+            r.g = p[1];
+            r.b = p[0];
+            return r;
+        default:
+            return r;
+    }
+}
+
 mRGB get_point_abs(filter_data *f, uint32_t x, uint32_t y)
 {
+    if (f->frame)
+    {
+        return get_frame_point_abs(f->frame, x, y);
+    }
     uint8_t *p = f->ptr + (y * f->linesize + x * 4);
     mRGB r;
     r.r = p[0];
@@ -185,15 +546,28 @@ mRGB get_point_abs(filter_data *f, uint32_t x, uint32_t y)
     return r;
 }
 
+void get_image_size(filter_data *f, uint32_t *cx, uint32_t *cy)
+{
+    *cx = f->frame ? f->frame->width : f->cx;
+    *cy = f->frame ? f->frame->height : f->cy;
+}
+
 /**
  * ptr: RGBA pixels
  * width: in pixel
+ * x, y: normalized to the game viewport
  * return: RGB
  */
 mRGB get_point(filter_data *f, float x, float y)
 {
-    int ix = round_int(x * f->cx);
-    int iy = round_int(y * f->cy);
+    uint32_t cx, cy;
+    get_image_size(f, &cx, &cy);
+    x = f->vx + x * f->vw;
+    y = f->vy + y * f->vh;
+    int ix = round_int(x * cx);
+    int iy = round_int(y * cy);
+    if (ix >= (int)cx) ix = cx - 1;
+    if (iy >= (int)cy) iy = cy - 1;
     uint32_t r = 0;
     uint32_t g = 0;
     uint32_t b = 0;
@@ -337,8 +711,93 @@ bool is_time_panel(filter_data *f)
     return time_lr && time_tb && time_split;
 }
 
+bool is_border_pixel(filter_data *f, uint32_t x, uint32_t y)
+{
+    mRGB c = get_point_abs(f, x, y);
+    return c.r < BORDER_THRESHOLD && c.g < BORDER_THRESHOLD && c.b < BORDER_THRESHOLD;
+}
+
+bool is_border_line(filter_data *f, uint32_t pos, bool row, uint32_t from, uint32_t to)
+{
+    for (int i = 0; i < BORDER_SAMPLES; i++)
+    {
+        uint32_t p = from + (uint64_t)(to - from) * (2 * i + 1) / (2 * BORDER_SAMPLES);
+        if (!(row ? is_border_pixel(f, p, pos) : is_border_pixel(f, pos, p)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void reset_viewport(filter_data *f)
+{
+    f->vx = 0;
+    f->vy = 0;
+    f->vw = 1;
+    f->vh = 1;
+}
+
+/**
+ * find the game inside black bars / borders and remap probes onto it
+ */
+void calibrate_viewport(filter_data *f)
+{
+    uint32_t cx, cy;
+    get_image_size(f, &cx, &cy);
+    uint32_t top = 0, bottom = cy, left = 0, right = cx;
+
+    while (top < bottom && is_border_line(f, top, true, 0, cx)) top++;
+    while (bottom > top && is_border_line(f, bottom - 1, true, 0, cx)) bottom--;
+    while (left < right && is_border_line(f, left, false, top, bottom)) left++;
+    while (right > left && is_border_line(f, right - 1, false, top, bottom)) right--;
+
+    // mostly black frame (loading screen): keep the old remap, retry later
+    if ((right - left) * 2 < cx || (bottom - top) * 2 < cy)
+    {
+        f->candidate_hits = 0;
+        return;
+    }
+    // dark edges of a single frame (night scene, fade-in) are not bars,
+    // only take bars that stay put
+    uint32_t candidate[6] = {left, top, right, bottom, cx, cy};
+    if (f->candidate_hits && memcmp(candidate, f->candidate, sizeof(candidate)) == 0)
+    {
+        f->candidate_hits++;
+    }
+    else
+    {
+        memcpy(f->candidate, candidate, sizeof(candidate));
+        f->candidate_hits = 1;
+    }
+    if (f->candidate_hits < VIEWPORT_STABLE_SAMPLES)
+    {
+        return;
+    }
+    f->candidate_hits = 0;
+    f->vx = (float)left / cx;
+    f->vy = (float)top / cy;
+    f->vw = (float)(right - left) / cx;
+    f->vh = (float)(bottom - top) / cy;
+    f->viewport_cx = cx;
+    f->viewport_cy = cy;
+    os_atomic_set_bool(&f->calibrate, false);
+    blog(LOG_INFO, "viewport %u,%u %ux%u in %ux%u", left, top, right - left, bottom - top, cx, cy);
+}
+
 void identify(filter_data *f)
 {
+    uint32_t cx, cy;
+    get_image_size(f, &cx, &cy);
+    if (f->auto_viewport && (cx != f->viewport_cx || cy != f->viewport_cy))
+    {
+        os_atomic_set_bool(&f->calibrate, true);
+    }
+    if (os_atomic_load_bool(&f->calibrate))
+    {
+        calibrate_viewport(f);
+    }
+
     uint8_t *ptr = f->ptr;
     uint32_t width = f->cx;
     f->last_is_time_panel = f->is_time_panel;
@@ -358,10 +817,43 @@ void switch_scene(const char *scene)
     }
 }
 
+/**
+ * keep the captured source alive while no scene shows it, some sources
+ * stop producing frames when hidden
+ */
+void update_showing(filter_data *f)
+{
+    obs_source_t *parent = f->offscreen ? obs_filter_get_parent(f->source) : NULL;
+    if (parent == f->shown_parent)
+    {
+        return;
+    }
+    if (f->shown_parent)
+    {
+        obs_source_dec_showing(f->shown_parent);
+    }
+    if (parent)
+    {
+        obs_source_inc_showing(parent);
+    }
+    f->shown_parent = parent;
+}
+
+void my_source_filter_remove(void *data, obs_source_t *parent)
+{
+    filter_data *f = data;
+    if (f->shown_parent == parent)
+    {
+        obs_source_dec_showing(parent);
+        f->shown_parent = NULL;
+    }
+}
+
 void my_source_tick(void *data, float tk)
 {
     filter_data *f = data;
     check_size(f);
+    update_showing(f);
     f->time += tk;
     float t = f->time;
     char buf[128];
@@ -394,29 +886,96 @@ void my_source_tick(void *data, float tk)
     }
 }
 
-void my_source_render(void *data, gs_effect_t *effect)
+/**
+ * async sources already have the frame in memory, probe it there
+ * instead of rendering and reading it back from the GPU
+ */
+struct obs_source_frame *my_source_filter_video(void *data, struct obs_source_frame *frame)
 {
     filter_data *f = data;
 
+    // raw frames skip the effect filters below this one, e.g. crop/pad,
+    // only the rendered path sees what they leave
+    bool filtered = obs_filter_get_target(f->source) != obs_filter_get_parent(f->source);
+    if (filtered || !is_frame_supported(frame->format) || !frame->width || !frame->height)
+    {
+        os_atomic_set_bool(&f->async_active, false);
+        return frame;
+    }
+    os_atomic_set_bool(&f->async_active, true);
+    if (!f->pulling)
+    {
+        f->filtered_at = obs_get_video_frame_time();
+    }
+
+    if (f->frame_counter >= f->interval) {
+        f->frame_counter = 0;
+    }
+    if (0 != f->frame_counter++)
+    {
+        return frame;
+    }
+
+    f->frame = frame;
+    identify(f);
+    f->frame = NULL;
+    return frame;
+}
+
+/**
+ * advances the interval counter once per frame, however often and from
+ * wherever the filter is rendered
+ * return: whether this frame should be analyzed
+ */
+bool analysis_due(filter_data *f)
+{
+    uint64_t t = obs_get_video_frame_time();
+    if (t == f->counted_frame)
+    {
+        return false;
+    }
     if (f->counter >= f->interval) {
         f->counter = 0;
     }
-    if (0 != f->counter++)
+    if (0 != f->counter)
     {
-        obs_source_skip_video_filter(f->source);
-        return;
+        f->counter++;
+        f->counted_frame = t;
+        return false;
     }
+    // over budget: stay due and try again next frame
+    if (!scheduler_acquire())
+    {
+        return false;
+    }
+    f->counter++;
+    f->counted_frame = t;
+    return true;
+}
 
+/**
+ * render the target at analysis size, read it back and identify
+ * readback: false to only pull the frame through, async sources hand
+ * it to filter_video
+ * return: false when nothing was rendered
+ */
+bool render_target(filter_data *f, bool readback)
+{
     obs_source_t *source = f->source;
     uint32_t width = obs_source_get_width(source);
     uint32_t height = obs_source_get_height(source);
     obs_source_t *target = obs_filter_get_target(source);
     obs_source_t *parent = obs_filter_get_parent(source);
+    // the stage surface is only valid for the size picked in check_size
+    if (!target || !f->copy || !width || !height)
+    {
+        return false;
+    }
     gs_texrender_reset(f->render);
     gs_blend_state_push();
     gs_blend_function(GS_BLEND_ONE, GS_BLEND_ZERO);
 
-    if (gs_texrender_begin(f->render, width, height)) {
+    if (gs_texrender_begin(f->render, f->cx, f->cy)) {
         uint32_t parent_flags = obs_source_get_output_flags(target);
         bool custom_draw = (parent_flags & OBS_SOURCE_CUSTOM_DRAW) != 0;
         bool async = (parent_flags & OBS_SOURCE_ASYNC) != 0;
@@ -432,28 +991,80 @@ void my_source_render(void *data, gs_effect_t *effect)
         else
             obs_source_video_render(target);
 
-        gs_texture_t *tex = gs_texrender_get_texture(f->render);
-        gs_stage_texture(f->copy, tex);
-
-        
-        if (gs_stagesurface_map(f->copy, &f->ptr, &f->linesize))
+        if (readback)
         {
-            blog(LOG_DEBUG, "map success linesize: %u", f->linesize);
-            identify(f);
-            
-            gs_stagesurface_unmap(f->copy);
-            f->ptr = NULL;
-        }
-        else
-        {
-            blog(LOG_DEBUG, "texture map failed %p", f->copy);
+            gs_texture_t *tex = gs_texrender_get_texture(f->render);
+            gs_stage_texture(f->copy, tex);
+
+            if (gs_stagesurface_map(f->copy, &f->ptr, &f->linesize))
+            {
+                blog(LOG_DEBUG, "map success linesize: %u", f->linesize);
+                identify(f);
+
+                gs_stagesurface_unmap(f->copy);
+                f->ptr = NULL;
+            }
+            else
+            {
+                blog(LOG_DEBUG, "texture map failed %p", f->copy);
+            }
         }
 
         gs_texrender_end(f->render);
     }
     gs_blend_state_pop();
+    return true;
+}
 
-    draw_render(f->render, width, height);
+/**
+ * main render callback: keeps detection running while no scene shows
+ * the source
+ */
+void offscreen_render(void *param, uint32_t cx, uint32_t cy)
+{
+    filter_data *f = param;
+    if (!f->offscreen || !obs_source_enabled(f->source))
+    {
+        return;
+    }
+    // hidden async sources only reach filter_video when they are rendered,
+    // a source some scene shows already gets there on its own
+    if (os_atomic_load_bool(&f->async_active))
+    {
+        if (obs_get_video_frame_time() - f->filtered_at > ASYNC_IDLE_NS)
+        {
+            f->pulling = true;
+            render_target(f, false);
+            f->pulling = false;
+        }
+    }
+    else if (analysis_due(f))
+    {
+        render_target(f, true);
+    }
+}
+
+void my_source_render(void *data, gs_effect_t *effect)
+{
+    filter_data *f = data;
+
+    // filter_video or the offscreen driver does the sampling
+    if (f->offscreen || os_atomic_load_bool(&f->async_active) || !analysis_due(f) || !render_target(f, true))
+    {
+        obs_source_skip_video_filter(f->source);
+        return;
+    }
+
+    uint32_t width = obs_source_get_width(f->source);
+    uint32_t height = obs_source_get_height(f->source);
+    if (f->cx != width || f->cy != height)
+    {
+        obs_source_skip_video_filter(f->source);
+    }
+    else
+    {
+        draw_render(f->render, width, height);
+    }
 }
 
 void add_scene_to_property(obs_property_t *p)
@@ -470,12 +1081,27 @@ void add_scene_to_property(obs_property_t *p)
     obs_frontend_source_list_free(&list);
 }
 
+bool calibrate_clicked(obs_properties_t *props, obs_property_t *property, void *data)
+{
+    filter_data *f = data;
+    os_atomic_set_bool(&f->calibrate, true);
+    return false;
+}
+
 obs_properties_t *my_source_properties(void *unused)
 {
     obs_properties_t *ppts = obs_properties_create();
     obs_property_t *p;
 
     obs_properties_add_int_slider(ppts, "interval", "间隔帧数", 1, 240, 1);
+    p = obs_properties_add_list(ppts, "scale", "分析分辨率", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_INT);
+    obs_property_list_add_int(p, "原始", 1);
+    obs_property_list_add_int(p, "1/2", 2);
+    obs_property_list_add_int(p, "1/4", 4);
+    obs_property_list_add_int(p, "480p", ANALYSIS_SCALE_480P);
+    obs_properties_add_bool(ppts, "offscreen", "后台分析（不依赖场景可见）");
+    obs_properties_add_bool(ppts, "auto_viewport", "自动识别游戏画面区域");
+    obs_properties_add_button(ppts, "calibrate", "重新识别画面区域", calibrate_clicked);
     obs_properties_add_int_slider(ppts, "before_gaming", "进入游戏场景时间(秒)", 1, 15, 1);
     obs_properties_add_int_slider(ppts, "before_other", "进入空闲场景时间(秒)", 1, 15, 1);
     p = obs_properties_add_list(ppts, "other", "空闲场景", OBS_COMBO_TYPE_LIST, OBS_COMBO_FORMAT_STRING);
@@ -489,6 +1115,9 @@ obs_properties_t *my_source_properties(void *unused)
 void my_source_defaults(obs_data_t *settings)
 {
     obs_data_set_default_int(settings, "interval", 30);
+    obs_data_set_default_int(settings, "scale", 1);
+    obs_data_set_default_bool(settings, "offscreen", true);
+    obs_data_set_default_bool(settings, "auto_viewport", true);
     obs_data_set_default_int(settings, "before_gaming", 3);
     obs_data_set_default_int(settings, "before_other", 10);
 }
@@ -503,6 +1132,8 @@ struct obs_source_info my_source = {
     .update         = my_source_update,
     .video_tick     = my_source_tick,
     .video_render   = my_source_render,
+    .filter_video   = my_source_filter_video,
+    .filter_remove  = my_source_filter_remove,
     .get_properties = my_source_properties,
     .get_defaults   = my_source_defaults
 };
@@ -512,3 +1143,8 @@ bool obs_module_load(void)
     obs_register_source(&my_source);
     return true;
 }
+
+void obs_module_unload(void)
+{
+    pool_free();
+}